@@ -0,0 +1,319 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// HTTP content codings, decoded by hand (not by libcurl) so the cost of
+// decoding can be timed separately from the transfer.
+namespace codec
+{
+
+inline bool isSupported(const std::string& encoding)
+{
+    return encoding == "gzip" || encoding == "deflate" || encoding == "br"
+#ifdef HAVE_ZSTD
+        || encoding == "zstd"
+#endif
+        || encoding == "identity";
+}
+
+inline std::string supported()
+{
+#ifdef HAVE_ZSTD
+    return "gzip, deflate, br, zstd";
+#else
+    return "gzip, deflate, br";
+#endif
+}
+
+// output strings are reused: they are resized, never shrunk
+inline bool gzip(const std::string& in, std::string& out)
+{
+    z_stream z = {};
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return false;
+    }
+    out.resize(deflateBound(&z, in.size()));
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    z.avail_in = in.size();
+    z.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    z.avail_out = out.size();
+    int res = ::deflate(&z, Z_FINISH);
+    out.resize(out.size() - z.avail_out);
+    deflateEnd(&z);
+    return res == Z_STREAM_END;
+}
+
+inline bool brotli(const std::string& in, std::string& out)
+{
+    size_t size = BrotliEncoderMaxCompressedSize(in.size());
+    out.resize(size ? size : in.size() + 1024);
+    size = out.size();
+    bool ok = BrotliEncoderCompress(BROTLI_DEFAULT_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_DEFAULT_MODE,
+            in.size(), reinterpret_cast<const uint8_t*>(in.data()),
+            &size, reinterpret_cast<uint8_t*>(&out[0]));
+    out.resize(ok ? size : 0);
+    return ok;
+}
+
+#ifdef HAVE_ZSTD
+inline bool zstd(const std::string& in, std::string& out)
+{
+    out.resize(ZSTD_compressBound(in.size()));
+    size_t res = ZSTD_compress(&out[0], out.size(), in.data(), in.size(), ZSTD_CLEVEL_DEFAULT);
+    out.resize(ZSTD_isError(res) ? 0 : res);
+    return !ZSTD_isError(res);
+}
+#endif
+
+/*
+    Decoder state kept across responses, one per thread. zlib and zstd streams
+    are reset between responses. A Brotli decoder cannot be reset, so each
+    response gets a new one, but its memory comes from blocks the Decoder
+    keeps, so after the first responses decoding does not touch the heap.
+*/
+class Decoder
+{
+public:
+    Decoder() : zlibReady(false)
+#ifdef HAVE_ZSTD
+        , zstdStream(nullptr)
+#endif
+    {
+        z = {};
+        blocks.reserve(64);
+    }
+
+    Decoder(const Decoder&) = delete;
+    Decoder& operator=(const Decoder&) = delete;
+
+    ~Decoder()
+    {
+        if (zlibReady)
+        {
+            inflateEnd(&z);
+        }
+#ifdef HAVE_ZSTD
+        if (zstdStream)
+        {
+            ZSTD_freeDStream(zstdStream);
+        }
+#endif
+        for (void* block : blocks)
+        {
+            ::free(block);
+        }
+    }
+
+    bool decode(const std::string& encoding, const std::string& in, std::string& out)
+    {
+        if (encoding == "gzip" || encoding == "deflate")
+        {
+            return inflate(in, out);
+        }
+        if (encoding == "br")
+        {
+            return unbrotli(in, out);
+        }
+#ifdef HAVE_ZSTD
+        if (encoding == "zstd")
+        {
+            return unzstd(in, out);
+        }
+#endif
+        out.assign(in);
+        return encoding.empty() || encoding == "identity";
+    }
+
+private:
+    // size of each block, kept in front of the memory handed out
+    static const std::size_t HEADER = alignof(std::max_align_t);
+
+    // output strings are reused: they are resized, never shrunk
+    bool inflate(const std::string& in, std::string& out)
+    {
+        if (zlibReady && inflateReset(&z) != Z_OK)
+        {
+            inflateEnd(&z);
+            zlibReady = false;
+        }
+        if (!zlibReady)
+        {
+            z = {};
+            // 32: detect gzip or zlib header, which covers gzip and deflate
+            if (inflateInit2(&z, 15 + 32) != Z_OK)
+            {
+                return false;
+            }
+            zlibReady = true;
+        }
+        z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+        z.avail_in = in.size();
+        size_t used = 0;
+        int res;
+        for (;;)
+        {
+            if (used == out.size())
+            {
+                out.resize(std::max<size_t>(out.size() * 2, in.size() * 4 + 64));
+            }
+            z.next_out = reinterpret_cast<Bytef*>(&out[used]);
+            z.avail_out = out.size() - used;
+            res = ::inflate(&z, Z_NO_FLUSH);
+            used = out.size() - z.avail_out;
+            // keep going only while the output buffer was the limit
+            if (res == Z_STREAM_END || z.avail_out != 0 || (res != Z_OK && res != Z_BUF_ERROR))
+            {
+                break;
+            }
+        }
+        out.resize(used);
+        return res == Z_STREAM_END;
+    }
+
+    bool unbrotli(const std::string& in, std::string& out)
+    {
+        BrotliDecoderState* state = BrotliDecoderCreateInstance(allocate, release, this);
+        if (!state)
+        {
+            return false;
+        }
+        const uint8_t* next_in = reinterpret_cast<const uint8_t*>(in.data());
+        size_t avail_in = in.size();
+        size_t used = 0;
+        BrotliDecoderResult res = BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT;
+        while (res == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT)
+        {
+            if (used == out.size())
+            {
+                out.resize(std::max<size_t>(out.size() * 2, in.size() * 4 + 64));
+            }
+            uint8_t* next_out = reinterpret_cast<uint8_t*>(&out[used]);
+            size_t avail_out = out.size() - used;
+            res = BrotliDecoderDecompressStream(state, &avail_in, &next_in, &avail_out, &next_out, nullptr);
+            used = out.size() - avail_out;
+        }
+        BrotliDecoderDestroyInstance(state);
+        out.resize(used);
+        return res == BROTLI_DECODER_RESULT_SUCCESS;
+    }
+
+#ifdef HAVE_ZSTD
+    bool unzstd(const std::string& in, std::string& out)
+    {
+        if (zstdStream && ZSTD_isError(ZSTD_DCtx_reset(zstdStream, ZSTD_reset_session_only)))
+        {
+            ZSTD_freeDStream(zstdStream);
+            zstdStream = nullptr;
+        }
+        if (!zstdStream)
+        {
+            zstdStream = ZSTD_createDStream();
+            if (!zstdStream)
+            {
+                return false;
+            }
+        }
+        ZSTD_inBuffer input = {in.data(), in.size(), 0};
+        size_t used = 0;
+        size_t res = 1;
+        while (res != 0 && !ZSTD_isError(res))
+        {
+            if (used == out.size())
+            {
+                out.resize(std::max<size_t>(out.size() * 2, in.size() * 4 + 64));
+            }
+            else if (input.pos == input.size)
+            {
+                // frame incomplete with no input left
+                break;
+            }
+            ZSTD_outBuffer output = {&out[0], out.size(), used};
+            res = ZSTD_decompressStream(zstdStream, &output, &input);
+            used = output.pos;
+        }
+        out.resize(used);
+        return res == 0;
+    }
+#endif
+
+    // Brotli allocator: reuse the smallest free block that fits
+    static void* allocate(void* opaque, size_t size)
+    {
+        std::vector<void*>& blocks = static_cast<Decoder*>(opaque)->blocks;
+        size_t best = blocks.size();
+        for (size_t i = 0; i < blocks.size(); ++i)
+        {
+            size_t blockSize = *static_cast<size_t*>(blocks[i]);
+            if (blockSize >= size && (best == blocks.size() || blockSize < *static_cast<size_t*>(blocks[best])))
+            {
+                best = i;
+            }
+        }
+        void* block;
+        if (best < blocks.size())
+        {
+            block = blocks[best];
+            blocks[best] = blocks.back();
+            blocks.pop_back();
+        }
+        else
+        {
+            block = ::malloc(size + HEADER);
+            if (!block)
+            {
+                return nullptr;
+            }
+            *static_cast<size_t*>(block) = size;
+        }
+        return static_cast<char*>(block) + HEADER;
+    }
+
+    static void release(void* opaque, void* address)
+    {
+        if (address)
+        {
+            static_cast<Decoder*>(opaque)->blocks.push_back(static_cast<char*>(address) - HEADER);
+        }
+    }
+
+    z_stream z;
+    bool zlibReady;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream* zstdStream;
+#endif
+    // free blocks of earlier Brotli decoders
+    std::vector<void*> blocks;
+};
+
+inline bool encode(const std::string& encoding, const std::string& in, std::string& out)
+{
+    if (encoding == "gzip")
+    {
+        return gzip(in, out);
+    }
+    if (encoding == "br")
+    {
+        return brotli(in, out);
+    }
+#ifdef HAVE_ZSTD
+    if (encoding == "zstd")
+    {
+        return zstd(in, out);
+    }
+#endif
+    out.assign(in);
+    return encoding.empty() || encoding == "identity";
+}
+
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Log-linear histogram of durations in microseconds: values below 16us are
+// exact, above that each power of two is split into 16 linear buckets, so a
+// recorded value is off by at most ~6%. Buckets are what results files store.
+class Histogram
+{
+public:
+    static const int SUB_BUCKET_BITS = 4;
+    static const uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+
+    static size_t indexOf(uint64_t micros)
+    {
+        if (micros < SUB_BUCKETS)
+        {
+            return micros;
+        }
+        int exponent = 63 - __builtin_clzll(micros);
+        uint64_t sub = (micros >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+        return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+    }
+
+    // highest index any recorded value can map to
+    static size_t maxIndex()
+    {
+        return indexOf(UINT64_MAX);
+    }
+
+    // middle of the bucket, in seconds
+    static double valueOf(size_t index)
+    {
+        if (index < SUB_BUCKETS)
+        {
+            return index / 1e6;
+        }
+        int exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+        uint64_t sub = index % SUB_BUCKETS;
+        uint64_t width = uint64_t(1) << (exponent - SUB_BUCKET_BITS);
+        return ((SUB_BUCKETS + sub) * width + width / 2.0) / 1e6;
+    }
+
+    void record(double seconds)
+    {
+        setRange(std::min(min_, seconds), std::max(max_, seconds));
+        add(indexOf(static_cast<uint64_t>(std::max(0.0, std::round(seconds * 1e6)))), 1);
+    }
+
+    void add(size_t index, uint64_t count)
+    {
+        if (index >= counts_.size())
+        {
+            counts_.resize(index + 1, 0);
+        }
+        counts_[index] += count;
+        total_ += count;
+    }
+
+    // exact extremes of the recorded values, percentiles never leave them
+    void setRange(double min, double max)
+    {
+        min_ = min;
+        max_ = max;
+    }
+
+    uint64_t getCount() const { return total_; }
+    double getMin() const { return min_; }
+    double getMax() const { return max_; }
+    bool hasRange() const { return min_ <= max_; }
+    const std::vector<uint64_t>& getCounts() const { return counts_; }
+
+    // value of the rank-th smallest recorded value, rank starting at 1
+    double valueAtRank(uint64_t rank) const
+    {
+        double value = bucketAtRank(rank);
+        return hasRange() ? std::min(std::max(value, min_), max_) : value;
+    }
+
+    double percentile(double p) const
+    {
+        return valueAtRank(std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(p / 100 * total_))));
+    }
+
+    // distribution-free ~95% confidence interval of a percentile, from the
+    // normal approximation of the binomial distribution of its rank
+    std::pair<double, double> percentileInterval(double p) const
+    {
+        double n = total_;
+        double q = p / 100;
+        double spread = 1.96 * std::sqrt(n * q * (1 - q));
+        double low = std::floor(n * q - spread);
+        double high = std::ceil(n * q + spread) + 1;
+        return {valueAtRank(static_cast<uint64_t>(std::max(1.0, low))),
+                valueAtRank(static_cast<uint64_t>(std::min(std::max(n, 1.0), high)))};
+    }
+
+private:
+    double bucketAtRank(uint64_t rank) const
+    {
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i)
+        {
+            seen += counts_[i];
+            if (seen >= rank && counts_[i])
+            {
+                return valueOf(i);
+            }
+        }
+        return counts_.empty() ? 0 : valueOf(counts_.size() - 1);
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 0;
+    double min_ = HUGE_VAL;
+    double max_ = -HUGE_VAL;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Pool of reusable objects. Released objects keep whatever capacity they
+// grew (e.g. string buffers), so once the pool has reached its working size
+// acquire/release never allocate. The pool grows on demand instead of
+// blocking, so a slow server never stalls the producer.
+template<typename T>
+class SlabPool
+{
+public:
+    SlabPool() = default;
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    void reserve(std::size_t n)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        slabs.reserve(n);
+        freeList.reserve(n);
+        while (slabs.size() < n)
+        {
+            slabs.emplace_back(new T());
+            freeList.push_back(slabs.back().get());
+        }
+    }
+
+    T* acquire()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (freeList.empty())
+        {
+            slabs.emplace_back(new T());
+            // every slab may end up in the free list at once
+            freeList.reserve(slabs.capacity());
+            return slabs.back().get();
+        }
+        T* item = freeList.back();
+        freeList.pop_back();
+        return item;
+    }
+
+    void release(T* item)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        freeList.push_back(item);
+    }
+
+    std::size_t size()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        return slabs.size();
+    }
+
+private:
+    std::vector< std::unique_ptr<T> > slabs;
+    std::vector<T*> freeList;
+    std::mutex mtx;
+};
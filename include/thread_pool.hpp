@@ -1,7 +1,7 @@
 #pragma once
 
+#include <atomic>
 #include <vector>
-#include <queue>
 #include <memory>
 #include <thread>
 #include <mutex>
@@ -10,16 +10,77 @@
 #include <functional>
 #include <stdexcept>
 
+// fixed-capacity ring of tasks, grows only when full so steady-state
+// enqueue/dequeue never touches the heap (unlike std::deque nodes)
+class TaskRing
+{
+public:
+    void reserve(std::size_t n)
+    {
+        if (n > ring.size())
+        {
+            grow(n);
+        }
+    }
+    bool empty() const { return count == 0; }
+    std::size_t size() const { return count; }
+
+    void push(std::function<void()>&& task)
+    {
+        if (count == ring.size())
+        {
+            grow(ring.empty() ? 64 : ring.size() * 2);
+        }
+        ring[(head + count) % ring.size()] = std::move(task);
+        count++;
+    }
+
+    std::function<void()> pop()
+    {
+        std::function<void()> task = std::move(ring[head]);
+        ring[head] = nullptr;
+        head = (head + 1) % ring.size();
+        count--;
+        return task;
+    }
+
+private:
+    void grow(std::size_t n)
+    {
+        std::vector< std::function<void()> > next(n);
+        for (std::size_t i = 0; i < count; ++i)
+        {
+            next[i] = std::move(ring[(head + i) % ring.size()]);
+        }
+        ring.swap(next);
+        head = 0;
+    }
+
+    std::vector< std::function<void()> > ring;
+    std::size_t head = 0;
+    std::size_t count = 0;
+};
+
 class ThreadPool
 {
 public:
     void initialize(std::size_t);
     void clear();
     bool isInitialized() { return initialized; }
+    void reserve(std::size_t);
+    // tasks waiting for a free worker
+    std::size_t pending();
+    // workers currently running a task
+    std::size_t active() { return running.load(); }
 
     template<typename F, typename... Args>
     auto enqueue(F&& f, Args&&... args) -> std::future<typename std::result_of<F(Args...)>::type>;
 
+    // fire-and-forget: no packaged_task/future, a small trivially copyable
+    // callable is stored inline in std::function without allocating
+    template<typename F>
+    void post(F&& f);
+
     ThreadPool() = default;
     ThreadPool(std::size_t);
     ~ThreadPool();
@@ -28,12 +89,13 @@ private:
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
     // the task queue
-    std::queue< std::function<void()> > tasks;
+    TaskRing tasks;
     // synchronization
     std::mutex queue_mutex;
     std::condition_variable condition;
-    bool stop;
-    bool initialized;
+    bool stop = false;
+    bool initialized = false;
+    std::atomic<std::size_t> running{0};
 };
 
 inline void ThreadPool::initialize(std::size_t threads)
@@ -64,10 +126,11 @@ inline void ThreadPool::initialize(std::size_t threads)
                         {
                             return;
                         }
-                        task = std::move(this->tasks.front());
-                        this->tasks.pop();
+                        task = this->tasks.pop();
+                        this->running++;
                     }
                     task();
+                    this->running--;
                 }
             }
         );
@@ -75,7 +138,7 @@ inline void ThreadPool::initialize(std::size_t threads)
 }
 
 // the constructor just launches some amount of workers
-inline ThreadPool::ThreadPool(std::size_t threads) : stop(false), initialized(true)
+inline ThreadPool::ThreadPool(std::size_t threads)
 {
     initialize(threads);
 }
@@ -98,12 +161,38 @@ auto ThreadPool::enqueue(F&& f, Args&&... args) -> std::future<typename std::res
         {
             throw std::runtime_error("enqueue on stopped ThreadPool");
         }
-        tasks.emplace([task](){ (*task)(); });
+        tasks.push([task](){ (*task)(); });
     }
     condition.notify_one();
     return res;
 }
 
+template<typename F>
+void ThreadPool::post(F&& f)
+{
+    {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        if (stop)
+        {
+            throw std::runtime_error("post on stopped ThreadPool");
+        }
+        tasks.push(std::function<void()>(std::forward<F>(f)));
+    }
+    condition.notify_one();
+}
+
+inline std::size_t ThreadPool::pending()
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    return tasks.size();
+}
+
+inline void ThreadPool::reserve(std::size_t n)
+{
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    tasks.reserve(n);
+}
+
 inline void ThreadPool::clear()
 {
     if (!initialized)
@@ -119,6 +208,7 @@ inline void ThreadPool::clear()
     {
         worker.join();
     }
+    workers.clear();
     initialized = false;
 }
 
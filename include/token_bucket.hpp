@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Token bucket kept as a single atomic "theoretical arrival time" (GCRA):
+// taking a token is one compare-and-swap, with no queue of past sends.
+class TokenBucket
+{
+public:
+    TokenBucket(double rate, unsigned burst)
+        : interval(static_cast<int64_t>(1e9 / rate)),
+          tolerance(interval * (std::max(burst, 1u) - 1)),
+          tat(0)
+    {
+    }
+
+    // takes a token and returns 0, or returns the nanoseconds to wait
+    int64_t tryAcquire()
+    {
+        int64_t now = nowNanos();
+        int64_t current = tat.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            int64_t start = std::max(current, now);
+            if (start - now > tolerance)
+            {
+                return start - now - tolerance;
+            }
+            if (tat.compare_exchange_weak(current, start + interval, std::memory_order_relaxed))
+            {
+                return 0;
+            }
+        }
+    }
+
+    // give back a token taken by tryAcquire that could not be used
+    void refund()
+    {
+        tat.fetch_sub(interval, std::memory_order_relaxed);
+    }
+
+private:
+    static int64_t nowNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    const int64_t interval;
+    const int64_t tolerance;
+    std::atomic<int64_t> tat;
+};
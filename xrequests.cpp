@@ -4,20 +4,30 @@
 #include <cassert>
 #include <chrono>
 #include <cmath>
+#include <codec.hpp>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <curl/curl.h>
 #include <fstream>
 #include <functional>
+#include <histogram.hpp>
 #include <iomanip>
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <new>
 #include <random>
+#include <signal.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <slab_pool.hpp>
 #include <sstream>
 #include <stdio.h>
 #include <thread>
 #include <thread_pool.hpp>
+#include <token_bucket.hpp>
+#include <unordered_map>
 #include <unistd.h>
 #include <vector>
 #include <jsoncpp/json/json.h>
@@ -25,6 +35,70 @@
 using namespace std;
 typedef std::chrono::high_resolution_clock Clock;
 
+/*
+    Counts heap allocations so the report can show what the request path
+    costs: C++ operator new, and libcurl through the allocator given to
+    curl_global_init_mem (including the zlib streams libcurl creates).
+    Decoders in codec.hpp allocate through malloc and are not counted.
+*/
+static std::atomic<unsigned long> heapAllocations(0);
+static std::atomic<unsigned long> curlAllocations(0);
+
+void* curlMalloc(size_t size)
+{
+    curlAllocations.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size);
+}
+
+void* curlCalloc(size_t count, size_t size)
+{
+    curlAllocations.fetch_add(1, std::memory_order_relaxed);
+    return calloc(count, size);
+}
+
+void* curlRealloc(void* p, size_t size)
+{
+    curlAllocations.fetch_add(1, std::memory_order_relaxed);
+    return realloc(p, size);
+}
+
+char* curlStrdup(const char* str)
+{
+    curlAllocations.fetch_add(1, std::memory_order_relaxed);
+    return strdup(str);
+}
+
+struct Allocations
+{
+    unsigned long cpp;
+    unsigned long curl;
+};
+
+Allocations countAllocations()
+{
+    return {heapAllocations.load(), curlAllocations.load()};
+}
+
+void* operator new(std::size_t size)
+{
+    heapAllocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    free(p);
+}
+
 template<typename T, typename Predicate = function<bool(T)>>
 class Statistic
 {
@@ -74,6 +148,11 @@ public:
         }
     }
 
+    void reserve(unsigned _count)
+    {
+        values_.reserve(_count);
+    }
+
     void clear()
     {
         sum_ = 0;
@@ -102,6 +181,13 @@ void die(const std::string& msg)
     exit(1);
 }
 
+// --warmup/--cooldown: a number of requests or a duration in seconds
+struct Window
+{
+    unsigned requests;
+    double seconds;
+};
+
 typedef struct Arguments
 {
     string inputFile;
@@ -118,13 +204,26 @@ typedef struct Arguments
     string output;
     string responseTimeOutput;
     string dataFile;
+    int drainTimeout;
+    string checkpoint;
+    bool resume;
+    double rate;
+    double hostRate;
+    map<string, double> hostRates;
+    int burst;
+    string compressed;
+    string compressBody;
+    Window warmup;
+    Window cooldown;
+    double steadyTolerance;
+    string results;
     void print()
     {
         cout << "inputFile " << inputFile << endl;
     }
 } Arguments;
 
-Arguments defaultArguments = {"", "", 1000, 1000, 1000, 0, 1000, false, false, false, false, "response", "response_time", ""};
+Arguments defaultArguments = {"", "", 1000, 1000, 1000, 0, 1000, false, false, false, false, "response", "response_time", "", 5000, "checkpoint", false, 0, 0, {}, 1, "", "", {0, 0}, {0, 0}, 10, "results"};
 
 enum CompressOptions : int
 {
@@ -141,7 +240,21 @@ enum CompressOptions : int
     RESPONSE_TIME_OUTPUT = 0x94,
     SEQUENT = 0x95,
     TIME_OUT = 0x96,
-    TIME_RANGE = 0x97
+    TIME_RANGE = 0x97,
+    DRAIN_TIMEOUT = 0x98,
+    CHECKPOINT = 0x99,
+    RESUME = 0x9a,
+    RATE = 0x9b,
+    HOST_RATE = 0x9c,
+    BURST = 0x9d,
+    COMPRESSED = 0x9e,
+    COMPRESS_BODY = 0x9f,
+    WARMUP = 0xa0,
+    COOLDOWN = 0xa1,
+    STEADY_TOLERANCE = 0xa2,
+    RESULTS = 0xa3,
+    THRESHOLD = 0xa4,
+    PERCENTILES = 0xa5
 };
 
 map<CompressOptions, string> ArgumentsDescriptions =
@@ -159,7 +272,25 @@ map<CompressOptions, string> ArgumentsDescriptions =
     { CompressOptions::POST, string("Use HTTP POST method.") + "\n"},
     { CompressOptions::DATA_FILE, string("Data file path to send") + "\n"},
     { CompressOptions::REPEAT_DATA, string("When there're request to send but out of data, re-read DATA_FILE from the begin.") + "\n"},
-    { CompressOptions::SEQUENT, string("Send requests sequently.") + "\n"}
+    { CompressOptions::SEQUENT, string("Send requests sequently.") + "\n"},
+    { CompressOptions::DRAIN_TIMEOUT, string("On SIGINT/SIGTERM, time in millisecond to let in-flight requests finish before aborting them.") + "\nDefault: " + to_string(defaultArguments.drainTimeout) + "\n"},
+    { CompressOptions::CHECKPOINT, string("Output path for the input offsets reached, used by --resume.") + "\nDefault: " + defaultArguments.checkpoint + "\n"},
+    { CompressOptions::RESUME, string("Continue from the offsets saved in CHECKPOINT instead of the first line.") + "\n"},
+    { CompressOptions::RATE, string("Maximum requests per second over all hosts, 0 for no limit.") + "\nDefault: " + to_string(int(defaultArguments.rate)) + "\n"},
+    { CompressOptions::HOST_RATE, string("Maximum requests per second to one host. Without HOST= it applies to every host not given its own rate. Can be repeated.") + "\n"},
+    { CompressOptions::BURST, string("Number of requests a RATE or HOST_RATE limit lets through at once.") + "\nDefault: " + to_string(defaultArguments.burst) + "\n"},
+    { CompressOptions::COMPRESSED, string("Ask for compressed responses and report wire bytes, decoded bytes and decode time.") + "\nDefault ENCODINGS: \"" + codec::supported() + "\"\n"},
+    { CompressOptions::COMPRESS_BODY, string("Compress POST data with ENCODING (gzip, br") +
+#ifdef HAVE_ZSTD
+        ", zstd" +
+#endif
+        ") and send it with Content-Encoding." + "\n"},
+    { CompressOptions::WARMUP, string("First requests (N) or first duration (Ns, Nms) reported apart from the statistic.") + "\n"},
+    { CompressOptions::COOLDOWN, string("Last requests (N) or last duration (Ns, Nms) reported apart from the statistic.") + "\n"},
+    { CompressOptions::STEADY_TOLERANCE, string("Percent of throughput variation and latency drift still reported as steady state.") + "\nDefault: " + to_string(int(defaultArguments.steadyTolerance)) + "\n"},
+    { CompressOptions::RESULTS, string("Output path for the results file read by 'xrequests compare', empty to skip.") + "\nDefault: " + defaultArguments.results + "\n"},
+    { CompressOptions::THRESHOLD, string("Percent a percentile may grow before it counts as a regression.") + "\nDefault: 10\n"},
+    { CompressOptions::PERCENTILES, string("Comma separated percentiles to compare.") + "\nDefault: 50,90,95,99\n"}
 };
 
 static struct argp_option options[] =
@@ -184,6 +315,28 @@ static struct argp_option options[] =
         ArgumentsDescriptions[CompressOptions::MIN_DISTANCE].c_str(), 5},
     {"response-time-output",  CompressOptions::RESPONSE_TIME_OUTPUT, "RESPONSE_TIME_OUTPUT", 0,
         ArgumentsDescriptions[CompressOptions::RESPONSE_TIME_OUTPUT].c_str(), 5},
+    {"drain-timeout",  CompressOptions::DRAIN_TIMEOUT, "DRAIN_TIMEOUT", 0,
+        ArgumentsDescriptions[CompressOptions::DRAIN_TIMEOUT].c_str(), 5},
+    {"checkpoint",  CompressOptions::CHECKPOINT, "CHECKPOINT", 0,
+        ArgumentsDescriptions[CompressOptions::CHECKPOINT].c_str(), 5},
+    {"rate",  CompressOptions::RATE, "RATE", 0,
+        ArgumentsDescriptions[CompressOptions::RATE].c_str(), 5},
+    {"host-rate",  CompressOptions::HOST_RATE, "[HOST=]RATE", 0,
+        ArgumentsDescriptions[CompressOptions::HOST_RATE].c_str(), 5},
+    {"burst",  CompressOptions::BURST, "BURST", 0,
+        ArgumentsDescriptions[CompressOptions::BURST].c_str(), 5},
+    {"compressed",  CompressOptions::COMPRESSED, "ENCODINGS", OPTION_ARG_OPTIONAL,
+        ArgumentsDescriptions[CompressOptions::COMPRESSED].c_str(), 5},
+    {"compress-body",  CompressOptions::COMPRESS_BODY, "ENCODING", 0,
+        ArgumentsDescriptions[CompressOptions::COMPRESS_BODY].c_str(), 5},
+    {"warmup",  CompressOptions::WARMUP, "N|DURATION", 0,
+        ArgumentsDescriptions[CompressOptions::WARMUP].c_str(), 5},
+    {"cooldown",  CompressOptions::COOLDOWN, "N|DURATION", 0,
+        ArgumentsDescriptions[CompressOptions::COOLDOWN].c_str(), 5},
+    {"steady-tolerance",  CompressOptions::STEADY_TOLERANCE, "PERCENT", 0,
+        ArgumentsDescriptions[CompressOptions::STEADY_TOLERANCE].c_str(), 5},
+    {"results",  CompressOptions::RESULTS, "RESULTS", 0,
+        ArgumentsDescriptions[CompressOptions::RESULTS].c_str(), 5},
     {"post",  CompressOptions::POST, 0, 0,
         ArgumentsDescriptions[CompressOptions::POST].c_str(), 6},
     {"repeat-data",  CompressOptions::REPEAT_DATA, 0, 0,
@@ -192,11 +345,35 @@ static struct argp_option options[] =
         ArgumentsDescriptions[CompressOptions::NO_BODY].c_str(), 6},
     {"sequent",  CompressOptions::SEQUENT, 0, 0,
         ArgumentsDescriptions[CompressOptions::SEQUENT].c_str(), 6},
+    {"resume",  CompressOptions::RESUME, 0, 0,
+        ArgumentsDescriptions[CompressOptions::RESUME].c_str(), 6},
     {0, 0, 0, 0, 0, 0}
 };
 
 static char args_doc[] = "";
-static char doc[] = "Simultaneously send multiple HTTP requests";
+static char doc[] = "Simultaneously send multiple HTTP requests"
+    "\vRun 'xrequests compare BASE RESULTS...' to compare saved results files.";
+
+Window parseWindow(const char* arg)
+{
+    char* end;
+    double value = fabs(strtod(arg, &end));
+    string unit = end;
+    if (unit.empty())
+    {
+        return {static_cast<unsigned>(value), 0};
+    }
+    if (unit == "s")
+    {
+        return {0, value};
+    }
+    if (unit == "ms")
+    {
+        return {0, value / 1000};
+    }
+    die(string("Invalid window: ") + arg + ", expected N, Ns or Nms");
+    return {0, 0};
+}
 
 static error_t parse_opt (int key, char *arg, struct argp_state *state)
 {
@@ -248,12 +425,81 @@ static error_t parse_opt (int key, char *arg, struct argp_state *state)
         case CompressOptions::SEQUENT:
             arguments->sequent = true;
             break;
+        case CompressOptions::DRAIN_TIMEOUT:
+            arguments->drainTimeout = abs(atoi(arg));
+            break;
+        case CompressOptions::CHECKPOINT:
+            arguments->checkpoint = arg;
+            break;
+        case CompressOptions::RESUME:
+            arguments->resume = true;
+            break;
+        case CompressOptions::RATE:
+            arguments->rate = fabs(atof(arg));
+            break;
+        case CompressOptions::HOST_RATE:
+        {
+            string value = arg;
+            auto pos = value.rfind('=');
+            if (pos == string::npos)
+            {
+                arguments->hostRate = fabs(atof(arg));
+            }
+            else
+            {
+                arguments->hostRates[value.substr(0, pos)] = fabs(atof(value.c_str() + pos + 1));
+            }
+            break;
+        }
+        case CompressOptions::BURST:
+            arguments->burst = max(1, abs(atoi(arg)));
+            break;
+        case CompressOptions::COMPRESSED:
+        {
+            arguments->compressed = arg ? arg : codec::supported();
+            stringstream encodings(arguments->compressed);
+            string encoding;
+            while (getline(encodings, encoding, ','))
+            {
+                encoding.erase(0, encoding.find_first_not_of(' '));
+                encoding.erase(encoding.find_last_not_of(' ') + 1);
+                if (!codec::isSupported(encoding))
+                {
+                    die("Unsupported encoding for --compressed: " + encoding);
+                }
+            }
+            break;
+        }
+        case CompressOptions::COMPRESS_BODY:
+            if (!codec::isSupported(arg) || string(arg) == "deflate")
+            {
+                die(string("Unsupported encoding for --compress-body: ") + arg);
+            }
+            arguments->compressBody = arg;
+            break;
+        case CompressOptions::WARMUP:
+            arguments->warmup = parseWindow(arg);
+            break;
+        case CompressOptions::COOLDOWN:
+            arguments->cooldown = parseWindow(arg);
+            break;
+        case CompressOptions::STEADY_TOLERANCE:
+            arguments->steadyTolerance = fabs(atof(arg));
+            break;
+        case CompressOptions::RESULTS:
+            arguments->results = arg;
+            break;
         case ARGP_KEY_END:
             if (arguments->inputFile ==  "")
             {
                 printError("--input is required");
                 exit(1);
             }
+            if (!arguments->compressBody.empty() && !arguments->post)
+            {
+                printError("--compress-body needs --post or --data-file");
+                exit(1);
+            }
             break;
         default:
             return ARGP_ERR_UNKNOWN;
@@ -265,11 +511,358 @@ static struct argp argp = {options, parse_opt, args_doc, doc, 0, 0, 0};
 static Arguments arguments;
 static ofstream output_file;
 
+const size_t URL_BUFFER_SIZE = 256;
+const size_t RESPONSE_BUFFER_SIZE = 64 * 1024;
+
+// one queued request, recycled through a SlabPool
+struct Request
+{
+    string url;
+    string postData;
+    // where this request was read from, so an unsent one can be resumed
+    int line;
+    streamoff inputOffset;
+    streamoff dataOffset;
+    // order of dispatch in this run
+    unsigned sequence;
+    // seconds after run start the schedule meant to send it
+    double intendedTime;
+    // seconds it waited for rate limit tokens before going to the pool
+    double tokenWait;
+    // next request waiting for tokens of the same host
+    Request* next;
+    Request() : line(0), inputOffset(0), dataOffset(0), sequence(0), intendedTime(0), tokenWait(0), next(nullptr)
+    {
+        url.reserve(URL_BUFFER_SIZE);
+    }
+};
+
+// what the worker learned about its current request; sizes and codec
+// timings are only filled in compression modes
+struct Transfer
+{
+    unsigned sequence;
+    double intendedTime;
+    double tokenWait;
+    double sendTime;
+    float timings[4];
+    double wireBytes;
+    double decodedBytes;
+    double decodeTime;
+    double bodyBytes;
+    double bodyWireBytes;
+    double encodeTime;
+    bool decodeFailed;
+};
+
+double threadCpuTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU time of each worker thread, added when the thread exits
+mutex workerCpuMtx;
+Statistic<double> workerCpuTimes;
+
+// per-thread curl handle and response buffer, reused for every request
+struct Worker
+{
+    CURL* curl;
+    string response;
+    bool aborted;
+    // compression modes: Content-Encoding seen, decoded response, encoded body
+    string contentEncoding;
+    string decoded;
+    string encodedBody;
+    codec::Decoder decoder;
+    Transfer transfer;
+    Worker() : curl(curl_easy_init())
+    {
+        response.reserve(RESPONSE_BUFFER_SIZE);
+        if (!arguments.compressed.empty())
+        {
+            decoded.reserve(RESPONSE_BUFFER_SIZE);
+        }
+    }
+    ~Worker()
+    {
+        {
+            lock_guard<mutex> lock(workerCpuMtx);
+            workerCpuTimes.addValue(threadCpuTime());
+        }
+        if (curl)
+        {
+            curl_easy_cleanup(curl);
+        }
+    }
+};
+
+Worker& localWorker()
+{
+    thread_local Worker worker;
+    return worker;
+}
+
+/*
+    Position in the input the run can be resumed from. On interrupt the
+    earliest request that was dropped or aborted wins; requests after it that
+    did complete will be sent again by --resume.
+*/
+struct Checkpoint
+{
+    int line;
+    streamoff inputOffset;
+    streamoff dataOffset;
+    bool completed;
+};
+
+volatile sig_atomic_t interruptSignal = 0;
+atomic<bool> interrupted(false);
+atomic<bool> forceStop(false);
+atomic<long long> drainDeadline(0);
+mutex checkpointMtx;
+Checkpoint resumePoint = {-1, 0, 0, false};
+unsigned unsentRequests = 0;
+int resumeLine = 0;
+
+long long monotonicMillis()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// only touches lock-free atomics and clock_gettime, both async-signal-safe
+void handleSignal(int signum)
+{
+    if (interrupted.load())
+    {
+        forceStop = true;
+        return;
+    }
+    interruptSignal = signum;
+    drainDeadline = monotonicMillis() + arguments.drainTimeout;
+    interrupted = true;
+}
+
+void installSignalHandlers()
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+}
+
+// abort the transfer once the drain deadline after an interrupt has passed
+int drainProgressCallback(void* receiver, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    if (interrupted.load() && (forceStop.load() || monotonicMillis() > drainDeadline.load()))
+    {
+        reinterpret_cast<Worker*>(receiver)->aborted = true;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+    Rate limits: one global bucket and one bucket per host. Limits are created
+    by the producer thread when a host is first seen. Requests that need tokens
+    queue per host in the RateLimiter, which hands them to the pool once they
+    hold their tokens, so pool workers never wait for a limit.
+*/
+struct HostLimit
+{
+    // nullptr when only the global limit applies to the host
+    unique_ptr<TokenBucket> bucket;
+    // requests waiting for tokens, oldest first
+    Request* head;
+    Request* tail;
+    // whether the RateLimiter has the host on its schedule
+    bool scheduled;
+};
+
+unique_ptr<TokenBucket> globalBucket;
+unordered_map<string, HostLimit> hostLimits;
+
+// host[:port] of an absolute url, written into _host to reuse its buffer
+void getHost(const string& _url, string& _host)
+{
+    size_t begin = _url.find("://");
+    begin = begin == string::npos ? 0 : begin + 3;
+    size_t end = _url.find_first_of("/?#", begin);
+    _host.assign(_url, begin, end == string::npos ? string::npos : end - begin);
+    size_t at = _host.rfind('@');
+    if (at != string::npos)
+    {
+        _host.erase(0, at + 1);
+    }
+}
+
+// limits of a host, nullptr when neither the host nor the run is limited
+HostLimit* getHostLimit(const string& _host)
+{
+    auto it = hostLimits.find(_host);
+    if (it == hostLimits.end())
+    {
+        auto rate = arguments.hostRates.find(_host);
+        double limit = rate != arguments.hostRates.end() ? rate->second : arguments.hostRate;
+        HostLimit hostLimit = {unique_ptr<TokenBucket>(limit > 0 ? new TokenBucket(limit, arguments.burst) : nullptr),
+            nullptr, nullptr, false};
+        it = hostLimits.emplace(_host, move(hostLimit)).first;
+    }
+    return it->second.bucket || globalBucket ? &it->second : nullptr;
+}
+
+// take a host token and a global token and return 0, or the nanoseconds to wait
+int64_t takeTokens(TokenBucket* _hostBucket)
+{
+    int64_t wait = _hostBucket ? _hostBucket->tryAcquire() : 0;
+    if (wait == 0 && globalBucket)
+    {
+        wait = globalBucket->tryAcquire();
+        if (wait != 0 && _hostBucket)
+        {
+            _hostBucket->refund();
+        }
+    }
+    return wait;
+}
+
+// sequent mode: wait in the producer for tokens; false if interrupted meanwhile
+bool acquireTokens(TokenBucket* _hostBucket)
+{
+    for (;;)
+    {
+        if (interrupted.load())
+        {
+            return false;
+        }
+        int64_t wait = takeTokens(_hostBucket);
+        if (wait == 0)
+        {
+            return true;
+        }
+        // wake up at least every 100ms to notice an interrupt
+        std::this_thread::sleep_for(std::chrono::nanoseconds(min<int64_t>(wait, 100000000)));
+    }
+}
+
+void markUnsent(const Request& request)
+{
+    lock_guard<mutex> lock(checkpointMtx);
+    unsentRequests++;
+    if (resumePoint.line < 0 || request.line < resumePoint.line)
+    {
+        resumePoint = {request.line, request.inputOffset, request.dataOffset, false};
+    }
+}
+
+void writeCheckpoint(const string& path, const Checkpoint& checkpoint)
+{
+    ofstream file(path);
+    if (!file.is_open())
+    {
+        printError("Could not write checkpoint: " + path);
+        return;
+    }
+    Json::Value res;
+    res["version"] = 1;
+    res["input"] = arguments.inputFile;
+    res["dataFile"] = arguments.dataFile;
+    res["line"] = checkpoint.line;
+    res["inputOffset"] = Json::Int64(checkpoint.inputOffset);
+    res["dataOffset"] = Json::Int64(checkpoint.dataOffset);
+    res["completed"] = checkpoint.completed;
+    file << res.toStyledString();
+}
+
+Checkpoint readCheckpoint(const string& path)
+{
+    ifstream file(path);
+    if (!file.is_open())
+    {
+        die("Could not read checkpoint: " + path);
+    }
+    Json::Value res;
+    Json::CharReaderBuilder builder;
+    string errors;
+    if (!Json::parseFromStream(builder, file, &res, &errors) || res["version"].asInt() != 1)
+    {
+        die("Invalid checkpoint: " + path + " " + errors);
+    }
+    if (res["input"].asString() != arguments.inputFile || res["dataFile"].asString() != arguments.dataFile)
+    {
+        die("Checkpoint " + path + " was written for input " + res["input"].asString());
+    }
+    return {res["line"].asInt(), res["inputOffset"].asInt64(), res["dataOffset"].asInt64(), res["completed"].asBool()};
+}
+
 mutex mtx;
 int process = 0;
 Statistic<double> statisticTotal;
 Statistic<double> statisticSuccess;
 
+/*
+    Every completion is kept as a sample and only sorted into warm-up,
+    measured and cool-down statistics once the run is over, since a cool-down
+    given as a duration depends on when the last request was sent.
+*/
+enum class Phase
+{
+    WARMUP,
+    MEASURED,
+    COOLDOWN
+};
+
+struct Sample
+{
+    double sendTime;
+    double responseTime;
+    unsigned sequence;
+    bool success;
+    // set by classifySamples once the run is over
+    Phase phase;
+    // seconds from start until dns, connect, tls and first byte were done
+    float timings[4];
+    // how much later than scheduled it was sent, rate limit waits excluded
+    float dispatchLag;
+    // compression modes, in the order of codecNames
+    double codec[6];
+};
+
+const char* timingNames[] = {"dns", "connect", "tls", "firstByte"};
+const char* codecNames[] = {"wireBytes", "decodedBytes", "decodeTime", "bodyBytes", "bodyWireBytes", "encodeTime"};
+
+vector<Sample> samples;
+double runStart = 0;
+Statistic<double> statisticWarmupTotal;
+Statistic<double> statisticWarmupSuccess;
+Statistic<double> statisticCooldownTotal;
+Statistic<double> statisticCooldownSuccess;
+
+struct SteadyState
+{
+    bool enough;
+    bool stable;
+    double duration;
+    double throughput;
+    // observed and Poisson-expected variation of completions per slice
+    double throughputCv;
+    double throughputCvExpected;
+    // index of dispersion test statistic, chi-square with slices - 1 df
+    double throughputDispersion;
+    double latencyDrift;
+    // Welch t statistic of the first against the last third
+    double latencyDriftT;
+};
+
+SteadyState steadyState = {};
+
 size_t write_data_callback(void *contents, size_t size, size_t nmemb, void* receiver) {
     size_t realsize = size * nmemb;
     std::string& data = *reinterpret_cast<std::string*> (receiver);
@@ -277,6 +870,23 @@ size_t write_data_callback(void *contents, size_t size, size_t nmemb, void* rece
     return realsize;
 }
 
+// keeps the Content-Encoding of the response, curl does not decode it for us
+size_t header_callback(char* buffer, size_t size, size_t nitems, void* receiver)
+{
+    size_t realsize = size * nitems;
+    static const char name[] = "content-encoding:";
+    const size_t nameLength = sizeof(name) - 1;
+    if (realsize > nameLength && strncasecmp(buffer, name, nameLength) == 0)
+    {
+        string& encoding = *reinterpret_cast<std::string*>(receiver);
+        encoding.assign(buffer + nameLength, realsize - nameLength);
+        encoding.erase(0, encoding.find_first_not_of(" \t"));
+        encoding.erase(encoding.find_last_not_of(" \t\r\n") + 1);
+        transform(encoding.begin(), encoding.end(), encoding.begin(), ::tolower);
+    }
+    return realsize;
+}
+
 Arguments get_option(int argc, char** argv)
 {
     Arguments arguments = defaultArguments;
@@ -310,17 +920,17 @@ Json::Value make_json_array(const CONTAINER& container) {
 }
 
 template <typename T>
-vector<T> randomSum(T _sum, int _len, T _min = 0, int _factor = 100000 )
+void randomSum(vector<T>& res, T _sum, int _len, T _min = 0, int _factor = 100000 )
 {
+    res.clear();
     if ( _min * _len >= _sum)
     {
-        vector<T> res(_len, _sum / _len);
-        return res;
+        res.assign(_len, _sum / _len);
+        return;
     }
     minstd_rand gen(Clock::now().time_since_epoch().count());
     uniform_int_distribution<int> distribution(0, _factor);
     distribution(gen);
-    vector<T> res;
     T sum = 0;
     int l = _len;
     while(l--)
@@ -336,7 +946,6 @@ vector<T> randomSum(T _sum, int _len, T _min = 0, int _factor = 100000 )
         */
         i = static_cast<T>((i * 1.0) / sum * (_sum - (_min * _len)) + _min);
     }
-    return res;
 }
 
 template <typename T>
@@ -363,23 +972,54 @@ string readFile(const string& filePath)
     return buffer.str();
 }
 
-pair<unsigned, string> performCurl(const string& url, const int& timeout, const bool& noBody = false)
+/*
+    Reset the worker's handle for a new request. The handle is reused to avoid
+    re-allocating it, but every request still resolves the name, opens a fresh
+    connection and does a full TLS handshake, so the measured times stay
+    comparable with one handle per request.
+*/
+CURL* prepareCurl(Worker& worker, const string& url, const int& timeout, const bool& noBody)
 {
-    CURL *curl;
-    CURLcode res;
-    curl = curl_easy_init();
-    string data = "";
-    long response_code;
+    CURL *curl = worker.curl;
+    worker.response.clear();
     if (curl)
     {
+        curl_easy_reset(curl);
         curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
         if (noBody) {
               curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
         }
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data_callback);
         curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, reinterpret_cast<void*>(&data));
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, reinterpret_cast<void*>(&worker.response));
+        curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
+        curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 0L);
+        curl_easy_setopt(curl, CURLOPT_SSL_SESSIONID_CACHE, 0L);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, drainProgressCallback);
+        curl_easy_setopt(curl, CURLOPT_XFERINFODATA, reinterpret_cast<void*>(&worker));
+    }
+    worker.aborted = false;
+    worker.contentEncoding.clear();
+    if (curl && !arguments.compressed.empty())
+    {
+        // send Accept-Encoding but keep the body as it came over the wire
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, arguments.compressed.c_str());
+        curl_easy_setopt(curl, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, reinterpret_cast<void*>(&worker.contentEncoding));
+    }
+    return curl;
+}
 
+unsigned performCurl(Worker& worker, const string& url, const int& timeout, const bool& noBody = false)
+{
+    CURLcode res;
+    CURL *curl = prepareCurl(worker, url, timeout, noBody);
+    long response_code = 0;
+    if (curl)
+    {
         res = curl_easy_perform(curl);
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
         if(res != CURLE_OK)
@@ -387,31 +1027,27 @@ pair<unsigned, string> performCurl(const string& url, const int& timeout, const
             fprintf(stderr, "error: %s\n",
                     curl_easy_strerror(res));
         }
-        curl_easy_cleanup(curl);
     }
-    return {response_code, move(data)};
+    return response_code;
 }
 
-pair<unsigned, string> httpPost(const string& url, const string& postData, const int& timeout, const bool& noBody = false)
+// Content-Encoding header for --compress-body, shared read-only by all handles
+curl_slist* bodyHeaders = nullptr;
+
+unsigned httpPost(Worker& worker, const string& url, const string& postData, const int& timeout, const bool& noBody = false)
 {
-    CURL *curl;
     CURLcode res;
-    curl = curl_easy_init();
-    string data = "";
-    long response_code;
+    CURL *curl = prepareCurl(worker, url, timeout, noBody);
+    long response_code = 0;
     if (curl)
     {
-        curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-        if (noBody) {
-              curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-        }
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data_callback);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, reinterpret_cast<void*>(&data));
-
         curl_easy_setopt(curl, CURLOPT_POST, 1L);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postData.c_str());
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postData.data());
         curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, postData.size());
+        if (bodyHeaders)
+        {
+            curl_easy_setopt(curl, CURLOPT_HTTPHEADER, bodyHeaders);
+        }
 
         res = curl_easy_perform(curl);
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
@@ -420,9 +1056,8 @@ pair<unsigned, string> httpPost(const string& url, const string& postData, const
             fprintf(stderr, "error: %s\n",
                     curl_easy_strerror(res));
         }
-        curl_easy_cleanup(curl);
     }
-    return {response_code, move(data)};
+    return response_code;
 }
 
 void printProcess(float percent, float step = 0.01)
@@ -434,19 +1069,19 @@ void printProcess(float percent, float step = 0.01)
         return;
     }
 
-    std::ostringstream prefix;
-    prefix << "\033[;30;42m Progress: [" << std::setw (3) << std::to_string(int(percent * 100)) << "%] \033[0m" << " ";
-    std::string output = "[";
+    // printed from the request path, so build the bar without allocating
+    char output[64];
     for(int i=0; i != barLength; ++i)
     {
         if(i < pos)
-            output += "#";
+            output[i] = '#';
         else
-            output += ".";
+            output[i] = '.';
     }
-    output += "]\r";
+    output[barLength] = '\0';
     process = pos;
-    std::cout << prefix.str() << output;
+    std::cout << std::flush;
+    printf("\033[;30;42m Progress: [%3d%%] \033[0m [%s]\r", int(percent * 100), output);
     fflush(stdout);
 }
 
@@ -465,42 +1100,96 @@ void handleResponse(string response, double responseTime)
     mtx.unlock();
 }
 
-void handleResponse(pair<unsigned, string> response, double responseTime)
+Statistic<double> statisticWireBytes;
+Statistic<double> statisticDecodedBytes;
+Statistic<double> statisticDecodeTime;
+Statistic<double> statisticBodyBytes;
+Statistic<double> statisticBodyWireBytes;
+Statistic<double> statisticEncodeTime;
+map<string, unsigned> responseEncodings;
+unsigned decodeErrors = 0;
+
+void handleResponse(unsigned responseCode, const string& body, double responseTime, const Worker& worker)
 {
     if (!arguments.noBody)
     {
         if (arguments.output != "stdout")
         {
-            output_file << response.second << endl;
+            output_file << body << endl;
         }
         else
         {
-            cout << response.second << endl;
+            cout << body << endl;
         }
     }
     mtx.lock();
-    statisticTotal.addValue(responseTime);
-    if(response.first == 200)
+    const Transfer& transfer = worker.transfer;
+    Sample sample = {};
+    sample.sendTime = transfer.sendTime;
+    sample.responseTime = responseTime;
+    sample.sequence = transfer.sequence;
+    sample.success = responseCode == 200;
+    sample.phase = Phase::MEASURED;
+    copy(begin(transfer.timings), end(transfer.timings), sample.timings);
+    sample.dispatchLag = max(0.0, transfer.sendTime - transfer.intendedTime - transfer.tokenWait);
+    if (!arguments.compressed.empty())
     {
-        statisticSuccess.addValue(responseTime);
+        sample.codec[0] = transfer.wireBytes;
+        sample.codec[1] = transfer.decodedBytes;
+        sample.codec[2] = transfer.decodeTime;
+    }
+    if (!arguments.compressBody.empty())
+    {
+        sample.codec[3] = transfer.bodyBytes;
+        sample.codec[4] = transfer.bodyWireBytes;
+        sample.codec[5] = transfer.encodeTime;
+    }
+    samples.push_back(sample);
+    if (!arguments.compressed.empty())
+    {
+        statisticWireBytes.addValue(worker.transfer.wireBytes);
+        statisticDecodedBytes.addValue(worker.transfer.decodedBytes);
+        statisticDecodeTime.addValue(worker.transfer.decodeTime);
+        responseEncodings[worker.contentEncoding.empty() ? "identity" : worker.contentEncoding]++;
+        decodeErrors += worker.transfer.decodeFailed;
+    }
+    if (!arguments.compressBody.empty())
+    {
+        statisticBodyBytes.addValue(worker.transfer.bodyBytes);
+        statisticBodyWireBytes.addValue(worker.transfer.bodyWireBytes);
+        statisticEncodeTime.addValue(worker.transfer.encodeTime);
     }
-    printProcess(1.0 * statisticTotal.getCount() / arguments.limit, 0.01);
+    printProcess(1.0 * samples.size() / (arguments.limit - resumeLine), 0.01);
     mtx.unlock();
 }
 
-void fetch(const string& url, const Arguments& option, const string& postData = "")
+// returns false when the request was aborted by an interrupt and not recorded
+bool fetch(const string& url, const Arguments& option, const string& postData = "", unsigned sequence = 0)
 {
+    Worker& worker = localWorker();
+    worker.transfer.sequence = sequence;
+    const string* body = &postData;
+    if (option.post && !option.compressBody.empty())
+    {
+        auto encodeStart = microtime();
+        codec::encode(option.compressBody, postData, worker.encodedBody);
+        worker.transfer.encodeTime = microtime() - encodeStart;
+        worker.transfer.bodyBytes = postData.size();
+        worker.transfer.bodyWireBytes = worker.encodedBody.size();
+        body = &worker.encodedBody;
+    }
     auto startTime = microtime();
-    pair<unsigned, string> res;
+    worker.transfer.sendTime = startTime - runStart;
+    unsigned responseCode = 0;
     try
     {
         if (option.post)
         {
-            res = httpPost(url, postData, option.timeout, option.noBody);
+            responseCode = httpPost(worker, url, *body, option.timeout, option.noBody);
         }
         else
         {
-            res = performCurl(url, option.timeout, option.noBody);
+            responseCode = performCurl(worker, url, option.timeout, option.noBody);
         }
     }
     catch (exception& e)
@@ -508,44 +1197,495 @@ void fetch(const string& url, const Arguments& option, const string& postData =
         cout << "Error: " << e.what() << endl;
     }
     auto endTime = microtime();
-    handleResponse(res, endTime - startTime);
-}
-
-template<typename T>
-void printStatistic(Statistic<T> _total, Statistic<T> _success)
-{
-    auto countOn = _total.getFollowingValue();
-    printf("\n======== response times statistic ========\n");
-    printf("Total requests: %5d\n", _total.getCount());
-    printf("        lowest: %11.5fs\n", _total.getMin());
-    printf("       highest: %11.5fs\n", _total.getMax());
-    printf("          mean: %11.5fs\n", _total.getMean());
-    printf("       success: %5d ~ %6.2f %%\n", _success.getCount(), _success.getCount() * 100.0 / _total.getCount() );
-    for(auto& c : countOn)
+    if (worker.aborted)
     {
-        auto percent = c.second * 100.0 / _total.getCount();
-        printf("%14s: %5d ~ %6.2f %%\n", c.first.c_str(), c.second, percent);
+        return false;
     }
-
-    printf("\nSuccess requests: %5d\n", _success.getCount());
-    printf("          lowest: %11.5fs\n", _success.getMin());
-    printf("         highest: %11.5fs\n", _success.getMax());
-    printf("            mean: %11.5fs\n", _success.getMean());
-    countOn = _success.getFollowingValue();
-    for(auto& c : countOn)
+    const CURLINFO timingInfos[] = {CURLINFO_NAMELOOKUP_TIME_T, CURLINFO_CONNECT_TIME_T,
+        CURLINFO_APPCONNECT_TIME_T, CURLINFO_STARTTRANSFER_TIME_T};
+    for (int i = 0; i < 4; ++i)
     {
-        auto percent = c.second * 100.0 / _success.getCount();
-        printf("%16s: %5d ~ %6.2f %%\n", c.first.c_str(), c.second, percent);
+        curl_off_t micros = 0;
+        if (worker.curl)
+        {
+            curl_easy_getinfo(worker.curl, timingInfos[i], &micros);
+        }
+        worker.transfer.timings[i] = micros / 1e6;
     }
-
-    if (arguments.responseTimeOutput != "")
+    const string* response = &worker.response;
+    if (!option.compressed.empty())
     {
-        ofstream file(arguments.responseTimeOutput);
+        // decoding is client work, timed apart from the response time
+        worker.transfer.wireBytes = worker.response.size();
+        worker.transfer.decodeFailed = false;
+        worker.transfer.decodeTime = 0;
+        if (!worker.contentEncoding.empty() && worker.contentEncoding != "identity")
+        {
+            auto decodeStart = microtime();
+            worker.transfer.decodeFailed = !worker.decoder.decode(worker.contentEncoding, worker.response, worker.decoded);
+            worker.transfer.decodeTime = microtime() - decodeStart;
+            if (!worker.transfer.decodeFailed)
+            {
+                response = &worker.decoded;
+            }
+        }
+        worker.transfer.decodedBytes = response->size();
+    }
+    handleResponse(responseCode, *response, endTime - startTime, worker);
+    return true;
+}
+
+// send a request that holds its rate limit tokens; false when aborted
+bool sendRequest(const Request& request)
+{
+    Worker& worker = localWorker();
+    worker.transfer.tokenWait = request.tokenWait;
+    worker.transfer.intendedTime = request.intendedTime;
+    return fetch(request.url, arguments, request.postData, request.sequence);
+}
+
+void postRequest(ThreadPool& _pool, SlabPool<Request>& _requests, Request* _request)
+{
+    _pool.post([_request, &_requests]()
+        {
+            if (interrupted.load() || !sendRequest(*_request))
+            {
+                markUnsent(*_request);
+            }
+            _requests.release(_request);
+        });
+}
+
+/*
+    Holds rate limited requests until they have their tokens, then posts them
+    to the pool. Each host keeps its requests in order in its HostLimit and is
+    scheduled once, at the time its bucket says the next token is due, so a
+    slow host never delays requests to other hosts. Only this thread takes
+    tokens, under its mutex. Once `capacity` requests are waiting, submit
+    blocks the producer so a long replay does not read its whole input into
+    memory ahead of the limit.
+*/
+class RateLimiter
+{
+public:
+    RateLimiter(ThreadPool& _pool, SlabPool<Request>& _requests)
+        : pool(_pool), requests(_requests), count(0), capacity(0), finishing(false)
+    {
+    }
+
+    ~RateLimiter()
+    {
+        finish();
+    }
+
+    void start(size_t _hosts, size_t _capacity)
+    {
+        capacity = _capacity;
+        schedule.reserve(_hosts);
+        worker = thread(&RateLimiter::run, this);
+    }
+
+    // wait while the limiter is full; an interrupted request is still taken
+    // and dropped into the checkpoint by the limiter thread
+    void submit(HostLimit* _limit, Request* _request)
+    {
+        {
+            unique_lock<mutex> lock(mtx);
+            while (count >= capacity && !interrupted.load())
+            {
+                // wake up at least every 100ms to notice an interrupt
+                space.wait_for(lock, chrono::milliseconds(100));
+            }
+            _request->next = nullptr;
+            if (_limit->tail)
+            {
+                _limit->tail->next = _request;
+            }
+            else
+            {
+                _limit->head = _request;
+            }
+            _limit->tail = _request;
+            count++;
+            if (!_limit->scheduled)
+            {
+                _limit->scheduled = true;
+                push(nowNanos(), _limit);
+            }
+        }
+        condition.notify_one();
+    }
+
+    // requests still waiting for tokens
+    size_t waiting()
+    {
+        lock_guard<mutex> lock(mtx);
+        return count;
+    }
+
+    // post every waiting request as its tokens come, then stop
+    void finish()
+    {
+        {
+            lock_guard<mutex> lock(mtx);
+            finishing = true;
+        }
+        condition.notify_one();
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+    }
+
+private:
+    typedef pair<int64_t, HostLimit*> Due;
+
+    static int64_t nowNanos()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void push(int64_t _time, HostLimit* _limit)
+    {
+        schedule.push_back({_time, _limit});
+        push_heap(schedule.begin(), schedule.end(), greater<Due>());
+    }
+
+    // an interrupt drops everything still waiting into the checkpoint
+    void dropAll()
+    {
+        for (auto& due : schedule)
+        {
+            for (Request* request = due.second->head; request; )
+            {
+                Request* next = request->next;
+                markUnsent(*request);
+                requests.release(request);
+                request = next;
+            }
+            due.second->head = due.second->tail = nullptr;
+            due.second->scheduled = false;
+        }
+        schedule.clear();
+        count = 0;
+    }
+
+    void run()
+    {
+        // wake up at least every 100ms to notice an interrupt
+        const int64_t poll = 100000000;
+        unique_lock<mutex> lock(mtx);
+        for (;;)
+        {
+            if (interrupted.load())
+            {
+                dropAll();
+            }
+            if (schedule.empty())
+            {
+                if (finishing)
+                {
+                    return;
+                }
+                condition.wait_for(lock, chrono::nanoseconds(poll));
+                continue;
+            }
+            int64_t now = nowNanos();
+            if (schedule.front().first > now)
+            {
+                condition.wait_for(lock, chrono::nanoseconds(min(schedule.front().first - now, poll)));
+                continue;
+            }
+            pop_heap(schedule.begin(), schedule.end(), greater<Due>());
+            HostLimit* limit = schedule.back().second;
+            schedule.pop_back();
+            int64_t wait = takeTokens(limit->bucket.get());
+            if (wait == 0)
+            {
+                Request* request = limit->head;
+                limit->head = request->next;
+                if (!limit->head)
+                {
+                    limit->tail = nullptr;
+                }
+                count--;
+                space.notify_one();
+                request->tokenWait = max(0.0, microtime() - runStart - request->intendedTime);
+                postRequest(pool, requests, request);
+            }
+            if (limit->head)
+            {
+                push(now + wait, limit);
+            }
+            else
+            {
+                limit->scheduled = false;
+            }
+        }
+    }
+
+    ThreadPool& pool;
+    SlabPool<Request>& requests;
+    // hosts with waiting requests, earliest token first
+    vector<Due> schedule;
+    size_t count;
+    size_t capacity;
+    bool finishing;
+    mutex mtx;
+    condition_variable condition;
+    // signalled when a waiting request was posted to the pool
+    condition_variable space;
+    thread worker;
+};
+
+double getLastSend()
+{
+    double lastSend = 0;
+    for (const auto& sample : samples)
+    {
+        lastSend = max(lastSend, sample.sendTime);
+    }
+    return lastSend;
+}
+
+Phase getPhase(const Sample& _sample, unsigned _sent, double _lastSend)
+{
+    const Window& warmup = arguments.warmup;
+    const Window& cooldown = arguments.cooldown;
+    if (_sample.sequence < warmup.requests || _sample.sendTime < warmup.seconds)
+    {
+        return Phase::WARMUP;
+    }
+    if ((cooldown.requests && _sample.sequence + cooldown.requests >= _sent)
+        || (cooldown.seconds > 0 && _sample.sendTime > _lastSend - cooldown.seconds))
+    {
+        return Phase::COOLDOWN;
+    }
+    return Phase::MEASURED;
+}
+
+// sort the samples of a finished run into warm-up, measured and cool-down
+void classifySamples(unsigned _sent)
+{
+    double lastSend = getLastSend();
+    for (auto& sample : samples)
+    {
+        Statistic<double>* total = &statisticTotal;
+        Statistic<double>* success = &statisticSuccess;
+        Phase phase = sample.phase = getPhase(sample, _sent, lastSend);
+        if (phase == Phase::WARMUP)
+        {
+            total = &statisticWarmupTotal;
+            success = &statisticWarmupSuccess;
+        }
+        else if (phase == Phase::COOLDOWN)
+        {
+            total = &statisticCooldownTotal;
+            success = &statisticCooldownSuccess;
+        }
+        total->addValue(sample.responseTime);
+        if (sample.success)
+        {
+            success->addValue(sample.responseTime);
+        }
+    }
+}
+
+double coefficientOfVariation(const vector<double>& _values)
+{
+    double mean = 0;
+    for (auto v : _values)
+    {
+        mean += v;
+    }
+    mean /= _values.size();
+    double variance = 0;
+    for (auto v : _values)
+    {
+        variance += (v - mean) * (v - mean);
+    }
+    variance /= _values.size();
+    return mean ? sqrt(variance) / mean : 0;
+}
+
+/*
+    Split the measured window into slices by completion time. Throughput is
+    unsteady when completions per slice are significantly over-dispersed for
+    a Poisson process and the excess variation is above the tolerance.
+    Latency is unsteady when the mean latency of the last third of the slices
+    differs significantly from the first third (Welch's t-test) by more than
+    the tolerance. Noise alone therefore does not flag a short run.
+*/
+SteadyState detectSteadyState()
+{
+    const int slices = 10;
+    const unsigned minSamples = slices * 10;
+    // 95% critical values: chi-square with 9 df, normal two-sided
+    const double dispersionCritical = 16.92;
+    const double tCritical = 1.96;
+    SteadyState res = {};
+    vector<const Sample*> measured;
+    for (const auto& sample : samples)
+    {
+        if (sample.phase == Phase::MEASURED)
+        {
+            measured.push_back(&sample);
+        }
+    }
+    if (measured.size() < minSamples)
+    {
+        return res;
+    }
+    double begin = measured.front()->sendTime + measured.front()->responseTime;
+    double end = begin;
+    for (auto sample : measured)
+    {
+        begin = min(begin, sample->sendTime + sample->responseTime);
+        end = max(end, sample->sendTime + sample->responseTime);
+    }
+    res.duration = end - begin;
+    if (res.duration <= 0)
+    {
+        return res;
+    }
+    vector<double> completions(slices, 0);
+    vector<double> latencySum(slices, 0);
+    vector<double> latencySquares(slices, 0);
+    for (auto sample : measured)
+    {
+        int slice = min(slices - 1, static_cast<int>((sample->sendTime + sample->responseTime - begin) / res.duration * slices));
+        completions[slice]++;
+        latencySum[slice] += sample->responseTime;
+        latencySquares[slice] += sample->responseTime * sample->responseTime;
+    }
+
+    double perSlice = measured.size() * 1.0 / slices;
+    double cv = coefficientOfVariation(completions);
+    res.throughput = measured.size() / res.duration;
+    res.throughputCv = cv * 100;
+    res.throughputCvExpected = 100 / sqrt(perSlice);
+    res.throughputDispersion = cv * cv * perSlice * slices;
+    double excessCv = sqrt(max(0.0, cv * cv - 1 / perSlice)) * 100;
+    bool throughputUnsteady = res.throughputDispersion > dispersionCritical && excessCv > arguments.steadyTolerance;
+
+    double first = 0, firstSquares = 0, firstCount = 0, last = 0, lastSquares = 0, lastCount = 0;
+    for (int i = 0; i < slices / 3; ++i)
+    {
+        first += latencySum[i];
+        firstSquares += latencySquares[i];
+        firstCount += completions[i];
+        last += latencySum[slices - 1 - i];
+        lastSquares += latencySquares[slices - 1 - i];
+        lastCount += completions[slices - 1 - i];
+    }
+    res.enough = firstCount > 1 && lastCount > 1;
+    if (!res.enough)
+    {
+        return res;
+    }
+    first /= firstCount;
+    last /= lastCount;
+    double firstVariance = max(0.0, (firstSquares - firstCount * first * first) / (firstCount - 1));
+    double lastVariance = max(0.0, (lastSquares - lastCount * last * last) / (lastCount - 1));
+    double standardError = sqrt(firstVariance / firstCount + lastVariance / lastCount);
+    res.latencyDrift = first ? (last - first) / first * 100 : 0;
+    res.latencyDriftT = standardError > 0 ? (last - first) / standardError : 0;
+    bool latencyUnsteady = fabs(res.latencyDriftT) > tCritical && fabs(res.latencyDrift) > arguments.steadyTolerance;
+
+    res.stable = !throughputUnsteady && !latencyUnsteady;
+    return res;
+}
+
+Json::Value steadyStateJson(const SteadyState& _steady)
+{
+    Json::Value res;
+    res["enoughData"] = _steady.enough;
+    res["stable"] = _steady.stable;
+    res["throughput"] = _steady.throughput;
+    res["throughputCv"] = _steady.throughputCv;
+    res["throughputCvExpected"] = _steady.throughputCvExpected;
+    res["throughputDispersion"] = _steady.throughputDispersion;
+    res["latencyDrift"] = _steady.latencyDrift;
+    res["latencyDriftT"] = _steady.latencyDriftT;
+    return res;
+}
+
+// per-request compression arrays of one phase, in the same order as "total"
+void addCodecJson(Json::Value& _res, Phase _phase)
+{
+    for (int i = 0; i < 6; ++i)
+    {
+        // the first three come from --compressed, the others from --compress-body
+        if ((i < 3 ? arguments.compressed : arguments.compressBody).empty())
+        {
+            continue;
+        }
+        Json::Value values = Json::arrayValue;
+        for (const auto& sample : samples)
+        {
+            if (sample.phase == _phase)
+            {
+                values.append(sample.codec[i]);
+            }
+        }
+        _res[codecNames[i]] = values;
+    }
+}
+
+Json::Value phaseJson(Phase _phase, Statistic<double>& _total, Statistic<double>& _success)
+{
+    Json::Value res;
+    res["total"] = make_json_array(_total.getValues());
+    res["success"] = make_json_array(_success.getValues());
+    addCodecJson(res, _phase);
+    return res;
+}
+
+template<typename T>
+void printStatistic(Statistic<T> _total, Statistic<T> _success)
+{
+    auto countOn = _total.getFollowingValue();
+    printf("\n======== response times statistic ========\n");
+    printf("Total requests: %5d\n", _total.getCount());
+    printf("        lowest: %11.5fs\n", _total.getMin());
+    printf("       highest: %11.5fs\n", _total.getMax());
+    printf("          mean: %11.5fs\n", _total.getMean());
+    printf("       success: %5d ~ %6.2f %%\n", _success.getCount(), _success.getCount() * 100.0 / _total.getCount() );
+    for(auto& c : countOn)
+    {
+        auto percent = c.second * 100.0 / _total.getCount();
+        printf("%14s: %5d ~ %6.2f %%\n", c.first.c_str(), c.second, percent);
+    }
+
+    printf("\nSuccess requests: %5d\n", _success.getCount());
+    printf("          lowest: %11.5fs\n", _success.getMin());
+    printf("         highest: %11.5fs\n", _success.getMax());
+    printf("            mean: %11.5fs\n", _success.getMean());
+    countOn = _success.getFollowingValue();
+    for(auto& c : countOn)
+    {
+        auto percent = c.second * 100.0 / _success.getCount();
+        printf("%16s: %5d ~ %6.2f %%\n", c.first.c_str(), c.second, percent);
+    }
+
+    if (arguments.responseTimeOutput != "")
+    {
+        ofstream file(arguments.responseTimeOutput);
         if (file.is_open())
         {
             Json::Value res;
             res["total"] = make_json_array(_total.getValues());
             res["success"] = make_json_array(_success.getValues());
+            addCodecJson(res, Phase::MEASURED);
+            if (statisticWarmupTotal.getCount())
+            {
+                res["warmup"] = phaseJson(Phase::WARMUP, statisticWarmupTotal, statisticWarmupSuccess);
+            }
+            if (statisticCooldownTotal.getCount())
+            {
+                res["cooldown"] = phaseJson(Phase::COOLDOWN, statisticCooldownTotal, statisticCooldownSuccess);
+            }
+            res["steadyState"] = steadyStateJson(steadyState);
             /*
             bool first = true;
             for(const auto& r : _total.getValues())
@@ -564,9 +1704,10 @@ void printStatistic(Statistic<T> _total, Statistic<T> _success)
     }
 }
 
-string getNextPostData(ifstream& dataFile, const bool& repeatData)
+void getNextPostData(ifstream& dataFile, const bool& repeatData, string& data)
 {
-    string data;
+    // data is a recycled buffer; getline leaves it untouched once the file is exhausted
+    data.clear();
     if (!std::getline(dataFile, data))
     {
         if (dataFile.eof() && repeatData)
@@ -579,12 +1720,632 @@ string getNextPostData(ifstream& dataFile, const bool& repeatData)
             }
         }
     }
-    return data;
+}
+
+void printPhase(const char* _name, Statistic<double>& _total, Statistic<double>& _success)
+{
+    if (!_total.getCount())
+    {
+        return;
+    }
+    printf("\n%s requests: %5d (not in the statistic above)\n", _name, _total.getCount());
+    printf("        lowest: %11.5fs\n", _total.getMin());
+    printf("       highest: %11.5fs\n", _total.getMax());
+    printf("          mean: %11.5fs\n", _total.getMean());
+    printf("       success: %5d ~ %6.2f %%\n", _success.getCount(), _success.getCount() * 100.0 / _total.getCount());
+}
+
+void printSteadyState(const SteadyState& _steady)
+{
+    printf("\n======== steady state ========\n");
+    if (!_steady.enough)
+    {
+        printf("Not enough measured requests to tell, need at least 100 spread over the run\n");
+        return;
+    }
+    printf("      duration: %11.5fs\n", _steady.duration);
+    printf("    throughput: %11.2f/s, variation %6.2f %% (%.2f %% expected from noise)\n",
+            _steady.throughput, _steady.throughputCv, _steady.throughputCvExpected);
+    printf(" latency drift: %+11.2f %% (t = %+.2f)\n", _steady.latencyDrift, _steady.latencyDriftT);
+    if (_steady.stable)
+    {
+        printf("        steady: yes (no significant change beyond %.0f %%)\n", arguments.steadyTolerance);
+    }
+    else
+    {
+        printf("        steady: NO, throughput or latency changed significantly by more than %.0f %%\n", arguments.steadyTolerance);
+    }
+}
+
+void printCompression()
+{
+    if (!arguments.compressed.empty() && statisticWireBytes.getCount())
+    {
+        printf("\n======== response compression ========\n");
+        printf("Accept-Encoding: %s\n", arguments.compressed.c_str());
+        for (auto& e : responseEncodings)
+        {
+            printf("%15s: %5d ~ %6.2f %%\n", e.first.c_str(), e.second, e.second * 100.0 / statisticWireBytes.getCount());
+        }
+        printf("     wire bytes: %12.0f, mean %10.1f\n", statisticWireBytes.getSum(), statisticWireBytes.getMean());
+        printf("  decoded bytes: %12.0f, mean %10.1f\n", statisticDecodedBytes.getSum(), statisticDecodedBytes.getMean());
+        printf("          ratio: %12.3f\n", statisticWireBytes.getSum() ? statisticDecodedBytes.getSum() / statisticWireBytes.getSum() : 0.0);
+        printf("    decode time: %11.5fs, mean %11.5fs, highest %11.5fs\n",
+                statisticDecodeTime.getSum(), statisticDecodeTime.getMean(), statisticDecodeTime.getMax());
+        printf("  decode errors: %5u\n", decodeErrors);
+    }
+    if (!arguments.compressBody.empty() && statisticBodyBytes.getCount())
+    {
+        printf("\n======== request body compression (%s) ========\n", arguments.compressBody.c_str());
+        printf("     body bytes: %12.0f, mean %10.1f\n", statisticBodyBytes.getSum(), statisticBodyBytes.getMean());
+        printf("     wire bytes: %12.0f, mean %10.1f\n", statisticBodyWireBytes.getSum(), statisticBodyWireBytes.getMean());
+        printf("          ratio: %12.3f\n", statisticBodyWireBytes.getSum() ? statisticBodyBytes.getSum() / statisticBodyWireBytes.getSum() : 0.0);
+        printf("    encode time: %11.5fs, mean %11.5fs, highest %11.5fs\n",
+                statisticEncodeTime.getSum(), statisticEncodeTime.getMean(), statisticEncodeTime.getMax());
+    }
+}
+
+/*
+    Results file: a versioned summary of one run for 'xrequests compare'.
+    Latencies are stored as histogram buckets instead of raw values so the
+    file stays small for long runs.
+*/
+const char* RESULTS_FORMAT = "xrequests-results";
+const int RESULTS_VERSION = 1;
+
+Json::Value histogramJson(const Histogram& _histogram)
+{
+    Json::Value res;
+    res["subBucketBits"] = Histogram::SUB_BUCKET_BITS;
+    res["count"] = Json::UInt64(_histogram.getCount());
+    if (_histogram.hasRange())
+    {
+        res["min"] = _histogram.getMin();
+        res["max"] = _histogram.getMax();
+    }
+    Json::Value buckets = Json::arrayValue;
+    const auto& counts = _histogram.getCounts();
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        if (counts[i])
+        {
+            Json::Value bucket = Json::arrayValue;
+            bucket.append(Json::UInt64(i));
+            bucket.append(Json::UInt64(counts[i]));
+            buckets.append(bucket);
+        }
+    }
+    res["buckets"] = buckets;
+    return res;
+}
+
+Histogram histogramFromJson(const Json::Value& _value)
+{
+    Histogram res;
+    if (!_value.isObject())
+    {
+        die("Invalid results file: histogram is not an object");
+    }
+    if (_value["subBucketBits"].asInt() != Histogram::SUB_BUCKET_BITS)
+    {
+        die("Unsupported histogram layout in results file");
+    }
+    if (!_value["buckets"].isArray())
+    {
+        die("Invalid results file: histogram without buckets");
+    }
+    for (const auto& bucket : _value["buckets"])
+    {
+        if (!bucket.isArray() || bucket.size() != 2 || !bucket[0].isUInt64() || !bucket[1].isUInt64()
+            || bucket[0].asUInt64() > Histogram::maxIndex())
+        {
+            die("Invalid results file: histogram bucket out of range");
+        }
+        res.add(bucket[0].asUInt64(), bucket[1].asUInt64());
+    }
+    if (_value["min"].isNumeric() && _value["max"].isNumeric())
+    {
+        res.setRange(_value["min"].asDouble(), _value["max"].asDouble());
+    }
+    return res;
+}
+
+/*
+    Generator self-monitoring: a thread samples the ThreadPool queue and the
+    process CPU time while requests are sent. Together with each request's
+    dispatch lag this tells whether xrequests itself was the bottleneck.
+    Requests held back by --rate/--host-rate wait in the RateLimiter, not the
+    pool queue, and their lag counts from when they got their tokens, so a
+    rate limit alone never triggers a warning.
+*/
+const double MONITOR_INTERVAL = 0.1;
+const double LAG_WARNING = 0.005;
+const double LAG_SHARE_WARNING = 0.1;
+const double QUEUED_SHARE_WARNING = 0.1;
+const double CPU_MEAN_WARNING = 75;
+const double CPU_PEAK_WARNING = 90;
+const double PREEMPTIONS_WARNING = 5;
+
+struct MonitorSample
+{
+    double time;
+    unsigned queueDepth;
+    unsigned activeWorkers;
+    // requests held back by rate limits, not counted in queueDepth
+    unsigned rateLimited;
+    double cpuTime;
+};
+
+vector<MonitorSample> monitorSamples;
+mutex monitorMtx;
+condition_variable monitorCondition;
+bool stopMonitor = false;
+
+double processCpuTime(const rusage& _usage)
+{
+    return _usage.ru_utime.tv_sec + _usage.ru_utime.tv_usec / 1e6
+        + _usage.ru_stime.tv_sec + _usage.ru_stime.tv_usec / 1e6;
+}
+
+void monitorGenerator(ThreadPool& _pool, RateLimiter& _limiter)
+{
+    monitorSamples.reserve(3600);
+    unique_lock<mutex> lock(monitorMtx);
+    while (!stopMonitor)
+    {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        monitorSamples.push_back({microtime() - runStart, static_cast<unsigned>(_pool.pending()),
+            static_cast<unsigned>(_pool.active()), static_cast<unsigned>(_limiter.waiting()), processCpuTime(usage)});
+        monitorCondition.wait_for(lock, chrono::duration<double>(MONITOR_INTERVAL));
+    }
+}
+
+struct GeneratorLoad
+{
+    Histogram dispatchLag;
+    double maxDispatchLag;
+    double meanQueueDepth;
+    unsigned maxQueueDepth;
+    double queuedShare;
+    double meanRateLimited;
+    unsigned maxRateLimited;
+    unsigned cpus;
+    double meanCpu;
+    double peakCpu;
+    double producerCpu;
+    double workerCpu;
+    double busiestWorkerCpu;
+    unsigned workerThreads;
+    long voluntarySwitches;
+    long involuntarySwitches;
+    double preemptionsPerRequest;
+    vector<string> warnings;
+};
+
+GeneratorLoad generatorLoad;
+
+GeneratorLoad analyzeGenerator(const rusage& _start, const rusage& _end, double _wall, double _producerCpu)
+{
+    GeneratorLoad res = {};
+    res.maxDispatchLag = 0;
+    Histogram latency;
+    for (const auto& sample : samples)
+    {
+        res.dispatchLag.record(sample.dispatchLag);
+        res.maxDispatchLag = max<double>(res.maxDispatchLag, sample.dispatchLag);
+        latency.record(sample.responseTime);
+    }
+
+    unsigned queued = 0;
+    for (size_t i = 0; i < monitorSamples.size(); ++i)
+    {
+        const auto& sample = monitorSamples[i];
+        res.meanQueueDepth += sample.queueDepth;
+        res.maxQueueDepth = max(res.maxQueueDepth, sample.queueDepth);
+        queued += sample.queueDepth > 0;
+        res.meanRateLimited += sample.rateLimited;
+        res.maxRateLimited = max(res.maxRateLimited, sample.rateLimited);
+        if (i > 0)
+        {
+            const auto& previous = monitorSamples[i - 1];
+            double wall = sample.time - previous.time;
+            if (wall > 0)
+            {
+                res.peakCpu = max(res.peakCpu, (sample.cpuTime - previous.cpuTime) / wall);
+            }
+        }
+    }
+    if (!monitorSamples.empty())
+    {
+        res.meanQueueDepth /= monitorSamples.size();
+        res.queuedShare = queued * 1.0 / monitorSamples.size();
+        res.meanRateLimited /= monitorSamples.size();
+    }
+
+    res.cpus = max(1u, thread::hardware_concurrency());
+    res.meanCpu = _wall > 0 ? (processCpuTime(_end) - processCpuTime(_start)) / _wall / res.cpus * 100 : 0;
+    res.peakCpu = res.peakCpu / res.cpus * 100;
+    res.producerCpu = _producerCpu;
+    res.workerCpu = workerCpuTimes.getSum();
+    res.busiestWorkerCpu = workerCpuTimes.getMax();
+    res.workerThreads = workerCpuTimes.getCount();
+    res.voluntarySwitches = _end.ru_nvcsw - _start.ru_nvcsw;
+    res.involuntarySwitches = _end.ru_nivcsw - _start.ru_nivcsw;
+    res.preemptionsPerRequest = samples.empty() ? 0 : res.involuntarySwitches * 1.0 / samples.size();
+
+    char warning[256];
+    double lagP99 = res.dispatchLag.percentile(99);
+    if (samples.size() && lagP99 > LAG_WARNING && lagP99 > LAG_SHARE_WARNING * latency.percentile(50))
+    {
+        snprintf(warning, sizeof(warning), "requests left %.5fs (p99) later than scheduled", lagP99);
+        res.warnings.push_back(warning);
+    }
+    if (res.queuedShare > QUEUED_SHARE_WARNING)
+    {
+        snprintf(warning, sizeof(warning), "requests waited for a free worker %.0f%% of the time, up to %u queued",
+                res.queuedShare * 100, res.maxQueueDepth);
+        res.warnings.push_back(warning);
+    }
+    if (res.meanCpu > CPU_MEAN_WARNING || res.peakCpu > CPU_PEAK_WARNING)
+    {
+        snprintf(warning, sizeof(warning), "CPU usage %.0f%% on average, %.0f%% at peak of %u CPUs",
+                res.meanCpu, res.peakCpu, res.cpus);
+        res.warnings.push_back(warning);
+    }
+    if (res.preemptionsPerRequest > PREEMPTIONS_WARNING)
+    {
+        snprintf(warning, sizeof(warning), "threads were preempted %.1f times per request", res.preemptionsPerRequest);
+        res.warnings.push_back(warning);
+    }
+    return res;
+}
+
+void printGeneratorLoad(const GeneratorLoad& _load)
+{
+    printf("\n======== generator load ========\n");
+    printf("    dispatch lag: p50 %11.5fs, p99 %11.5fs, highest %11.5fs\n",
+            _load.dispatchLag.percentile(50), _load.dispatchLag.percentile(99), _load.maxDispatchLag);
+    printf("     queue depth: mean %6.2f, highest %5u, not empty %6.2f %% of the time\n",
+            _load.meanQueueDepth, _load.maxQueueDepth, _load.queuedShare * 100);
+    if (_load.maxRateLimited > 0)
+    {
+        printf("    rate limited: mean %6.2f, highest %5u waiting for tokens, not counted above\n",
+                _load.meanRateLimited, _load.maxRateLimited);
+    }
+    printf("       CPU usage: mean %6.2f %%, peak %6.2f %% of %u CPUs\n", _load.meanCpu, _load.peakCpu, _load.cpus);
+    printf(" thread CPU time: producer %.5fs, %u workers %.5fs, busiest %.5fs\n",
+            _load.producerCpu, _load.workerThreads, _load.workerCpu, _load.busiestWorkerCpu);
+    printf("context switches: voluntary %ld, involuntary %ld (%.2f per request)\n",
+            _load.voluntarySwitches, _load.involuntarySwitches, _load.preemptionsPerRequest);
+    for (const auto& warning : _load.warnings)
+    {
+        printf("[WARNING] generator may be saturated, latencies can be skewed: %s\n", warning.c_str());
+    }
+}
+
+Json::Value generatorLoadJson(const GeneratorLoad& _load)
+{
+    Json::Value res;
+    res["dispatchLag"] = histogramJson(_load.dispatchLag);
+    res["maxDispatchLag"] = _load.maxDispatchLag;
+    res["meanQueueDepth"] = _load.meanQueueDepth;
+    res["maxQueueDepth"] = _load.maxQueueDepth;
+    res["queuedShare"] = _load.queuedShare;
+    res["meanRateLimited"] = _load.meanRateLimited;
+    res["maxRateLimited"] = _load.maxRateLimited;
+    res["cpus"] = _load.cpus;
+    res["meanCpu"] = _load.meanCpu;
+    res["peakCpu"] = _load.peakCpu;
+    res["producerCpu"] = _load.producerCpu;
+    res["workerCpu"] = _load.workerCpu;
+    res["busiestWorkerCpu"] = _load.busiestWorkerCpu;
+    res["workerThreads"] = _load.workerThreads;
+    res["voluntarySwitches"] = Json::Int64(_load.voluntarySwitches);
+    res["involuntarySwitches"] = Json::Int64(_load.involuntarySwitches);
+    res["saturated"] = !_load.warnings.empty();
+    res["warnings"] = make_json_array(_load.warnings);
+    return res;
+}
+
+Json::Value configJson()
+{
+    Json::Value res;
+    res["inputFile"] = arguments.inputFile;
+    res["prefix"] = arguments.prefix;
+    res["limit"] = arguments.limit;
+    res["chunkSize"] = arguments.chunkSize;
+    res["timeRange"] = arguments.timeRange;
+    res["minDistance"] = arguments.minDistance;
+    res["timeout"] = arguments.timeout;
+    res["noBody"] = arguments.noBody;
+    res["post"] = arguments.post;
+    res["sequent"] = arguments.sequent;
+    res["dataFile"] = arguments.dataFile;
+    res["rate"] = arguments.rate;
+    res["hostRate"] = arguments.hostRate;
+    for (auto& hostRate : arguments.hostRates)
+    {
+        res["hostRates"][hostRate.first] = hostRate.second;
+    }
+    res["burst"] = arguments.burst;
+    res["compressed"] = arguments.compressed;
+    res["compressBody"] = arguments.compressBody;
+    res["warmupRequests"] = arguments.warmup.requests;
+    res["warmupSeconds"] = arguments.warmup.seconds;
+    res["cooldownRequests"] = arguments.cooldown.requests;
+    res["cooldownSeconds"] = arguments.cooldown.seconds;
+    res["resumedFromLine"] = resumeLine;
+    return res;
+}
+
+void writeResults(const string& _path, unsigned _sent)
+{
+    ofstream file(_path);
+    if (!file.is_open())
+    {
+        printError("Could not write results: " + _path);
+        return;
+    }
+    Json::Value res;
+    res["format"] = RESULTS_FORMAT;
+    res["version"] = RESULTS_VERSION;
+    time_t now = time(nullptr);
+    char createdAt[32];
+    strftime(createdAt, sizeof(createdAt), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    res["createdAt"] = createdAt;
+    res["config"] = configJson();
+
+    const char* phaseNames[] = {"warmup", "measured", "cooldown"};
+    Histogram latency[3];
+    Histogram timings[3][4];
+    unsigned success[3] = {0, 0, 0};
+    double duration = 0;
+    for (const auto& sample : samples)
+    {
+        int phase = static_cast<int>(sample.phase);
+        latency[phase].record(sample.responseTime);
+        for (int i = 0; i < 4; ++i)
+        {
+            timings[phase][i].record(sample.timings[i]);
+        }
+        success[phase] += sample.success;
+        duration = max(duration, sample.sendTime + sample.responseTime);
+    }
+    for (int phase = 0; phase < 3; ++phase)
+    {
+        Json::Value& value = res["phases"][phaseNames[phase]];
+        value["count"] = Json::UInt64(latency[phase].getCount());
+        value["success"] = success[phase];
+        value["latency"] = histogramJson(latency[phase]);
+        for (int i = 0; i < 4; ++i)
+        {
+            value["timings"][timingNames[i]] = histogramJson(timings[phase][i]);
+        }
+    }
+
+    // completions per second over the whole run: [second, completed, success, mean latency]
+    vector<unsigned> completed(static_cast<size_t>(duration) + 1, 0);
+    vector<unsigned> succeeded(completed.size(), 0);
+    vector<double> latencySum(completed.size(), 0);
+    for (const auto& sample : samples)
+    {
+        size_t second = static_cast<size_t>(sample.sendTime + sample.responseTime);
+        completed[second]++;
+        succeeded[second] += sample.success;
+        latencySum[second] += sample.responseTime;
+    }
+    Json::Value series = Json::arrayValue;
+    for (size_t i = 0; i < completed.size(); ++i)
+    {
+        Json::Value point = Json::arrayValue;
+        point.append(Json::UInt64(i));
+        point.append(completed[i]);
+        point.append(succeeded[i]);
+        point.append(completed[i] ? latencySum[i] / completed[i] : 0.0);
+        series.append(point);
+    }
+    res["throughput"]["interval"] = 1;
+    res["throughput"]["series"] = series;
+
+    res["summary"]["sent"] = _sent;
+    res["summary"]["completed"] = Json::UInt64(samples.size());
+    res["summary"]["duration"] = duration;
+    res["summary"]["throughput"] = duration > 0 ? samples.size() / duration : 0.0;
+    res["steadyState"] = steadyStateJson(steadyState);
+    res["generator"] = generatorLoadJson(generatorLoad);
+
+    Json::StreamWriterBuilder builder;
+    builder["indentation"] = "";
+    file << Json::writeString(builder, res) << endl;
+}
+
+struct CompareArguments
+{
+    vector<string> files;
+    double threshold;
+    vector<double> percentiles;
+};
+
+static struct argp_option compareOptions[] =
+{
+    {"threshold",  CompressOptions::THRESHOLD, "PERCENT", 0,
+        ArgumentsDescriptions[CompressOptions::THRESHOLD].c_str(), 0},
+    {"percentiles",  CompressOptions::PERCENTILES, "LIST", 0,
+        ArgumentsDescriptions[CompressOptions::PERCENTILES].c_str(), 0},
+    {0, 0, 0, 0, 0, 0}
+};
+
+static error_t parse_compare_opt(int key, char *arg, struct argp_state *state)
+{
+    CompareArguments *compare = static_cast<CompareArguments*>(state->input);
+    switch (key)
+    {
+        case CompressOptions::THRESHOLD:
+            compare->threshold = fabs(atof(arg));
+            break;
+        case CompressOptions::PERCENTILES:
+        {
+            compare->percentiles.clear();
+            stringstream list(arg);
+            string value;
+            while (getline(list, value, ','))
+            {
+                double p = atof(value.c_str());
+                if (p <= 0 || p > 100)
+                {
+                    die("Invalid percentile: " + value);
+                }
+                compare->percentiles.push_back(p);
+            }
+            break;
+        }
+        case ARGP_KEY_ARG:
+            compare->files.push_back(arg);
+            break;
+        case ARGP_KEY_END:
+            if (compare->files.size() < 2)
+            {
+                argp_usage(state);
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static char compare_args_doc[] = "BASE RESULTS...";
+static char compare_doc[] = "Compare results files against BASE. Exits with 2 when a percentile "
+    "grew by more than THRESHOLD and the growth is statistically significant.";
+
+Json::Value readResults(const string& _path)
+{
+    ifstream file(_path);
+    if (!file.is_open())
+    {
+        die("Could not read results file: " + _path);
+    }
+    Json::Value res;
+    Json::CharReaderBuilder builder;
+    string errors;
+    if (!Json::parseFromStream(builder, file, &res, &errors))
+    {
+        die("Invalid results file: " + _path + " " + errors);
+    }
+    if (res["format"].asString() != RESULTS_FORMAT || res["version"].asInt() != RESULTS_VERSION)
+    {
+        die("Unsupported results file: " + _path);
+    }
+    return res;
+}
+
+int compareResults(int argc, char** argv)
+{
+    CompareArguments compare = {{}, 10, {50, 90, 95, 99}};
+    struct argp compareArgp = {compareOptions, parse_compare_opt, compare_args_doc, compare_doc, 0, 0, 0};
+    argp_parse(&compareArgp, argc, argv, 0, 0, &compare);
+
+    Json::Value base = readResults(compare.files[0]);
+    Histogram baseLatency = histogramFromJson(base["phases"]["measured"]["latency"]);
+    if (!baseLatency.getCount())
+    {
+        die("No measured requests in " + compare.files[0]);
+    }
+    bool regression = false;
+    for (size_t f = 1; f < compare.files.size(); ++f)
+    {
+        Json::Value run = readResults(compare.files[f]);
+        Histogram latency = histogramFromJson(run["phases"]["measured"]["latency"]);
+        printf("\n======== %s vs %s ========\n", compare.files[f].c_str(), compare.files[0].c_str());
+        if (!latency.getCount())
+        {
+            printf("No measured requests\n");
+            regression = true;
+            continue;
+        }
+        double baseSuccess = base["phases"]["measured"]["success"].asDouble() * 100 / baseLatency.getCount();
+        double success = run["phases"]["measured"]["success"].asDouble() * 100 / latency.getCount();
+        printf("      requests: %10llu %10llu\n",
+                static_cast<unsigned long long>(baseLatency.getCount()), static_cast<unsigned long long>(latency.getCount()));
+        printf("       success: %9.2f%% %9.2f%%\n", baseSuccess, success);
+        printf("    throughput: %9.2f/s %8.2f/s\n",
+                base["summary"]["throughput"].asDouble(), run["summary"]["throughput"].asDouble());
+        if (!run["steadyState"]["stable"].asBool())
+        {
+            printf("   steady state not reached in %s, compare with care\n", compare.files[f].c_str());
+        }
+        for (size_t i = 0; i < 2; ++i)
+        {
+            const Json::Value& results = i ? run : base;
+            for (const auto& warning : results["generator"]["warnings"])
+            {
+                printf("   generator saturated in %s: %s\n", compare.files[i ? f : 0].c_str(), warning.asCString());
+            }
+        }
+        printf("%10s %11s %11s %9s  %s\n", "percentile", "base", "run", "change", "verdict");
+        for (auto p : compare.percentiles)
+        {
+            double before = baseLatency.percentile(p);
+            double after = latency.percentile(p);
+            double change = before ? (after - before) / before * 100 : 0;
+            auto beforeInterval = baseLatency.percentileInterval(p);
+            auto afterInterval = latency.percentileInterval(p);
+            // significant when the confidence intervals do not overlap
+            bool slower = afterInterval.first > beforeInterval.second;
+            bool faster = afterInterval.second < beforeInterval.first;
+            const char* verdict = "no significant change";
+            if (slower && change > compare.threshold)
+            {
+                verdict = "REGRESSION";
+                regression = true;
+            }
+            else if (slower)
+            {
+                verdict = "slower, within threshold";
+            }
+            else if (faster)
+            {
+                verdict = "faster";
+            }
+            char label[16];
+            snprintf(label, sizeof(label), "p%g", p);
+            printf("%10s %10.5fs %10.5fs %+8.2f%%  %s\n", label, before, after, change, verdict);
+        }
+    }
+    return regression ? 2 : 0;
+}
+
+void printAllocations(const Allocations& _start, const Allocations& _steady, const Allocations& _end, unsigned _steadyRequests)
+{
+    unsigned long cpp = _steadyRequests ? _end.cpp - _steady.cpp : 0;
+    unsigned long curl = _steadyRequests ? _end.curl - _steady.curl : 0;
+    printf("\n======== heap allocations ========\n");
+    printf("                      C++  libcurl\n");
+    printf("  while sending: %8lu %8lu\n", _end.cpp - _start.cpp, _end.curl - _start.curl);
+    printf("after 1st chunk: %8lu %8lu ~ %6.2f C++, %6.2f libcurl per request\n", cpp, curl,
+            _steadyRequests ? cpp * 1.0 / _steadyRequests : 0.0, _steadyRequests ? curl * 1.0 / _steadyRequests : 0.0);
+    if (!arguments.compressed.empty() || !arguments.compressBody.empty())
+    {
+        printf("(--compressed/--compress-body decoders and encoders are not counted)\n");
+    }
 }
 
 int main(int argc, char** argv)
 {
+    if (argc > 1 && string(argv[1]) == "compare")
+    {
+        try
+        {
+            return compareResults(argc - 1, argv + 1);
+        }
+        catch (Json::Exception& e)
+        {
+            die(string("Invalid results file: ") + e.what());
+        }
+    }
     arguments = get_option(argc, argv);
+    curl_global_init_mem(CURL_GLOBAL_ALL, curlMalloc, free, curlRealloc, curlStrdup, curlCalloc);
 
     std::ifstream inFile(arguments.inputFile);
     arguments.limit = min(arguments.limit,
@@ -610,9 +2371,33 @@ int main(int argc, char** argv)
             }
         }
         int line = 0;
+        streamoff inputOffset = 0;
+        if (arguments.resume)
+        {
+            Checkpoint checkpoint = readCheckpoint(arguments.checkpoint);
+            if (checkpoint.completed)
+            {
+                cout << "Checkpoint " << arguments.checkpoint << " is already completed, nothing to resume" << endl;
+                return 0;
+            }
+            line = resumeLine = checkpoint.line;
+            inputOffset = checkpoint.inputOffset;
+            file.seekg(inputOffset);
+            if (dataFile.is_open())
+            {
+                if (checkpoint.dataOffset < 0)
+                {
+                    dataFile.seekg(0, ios::end);
+                }
+                else
+                {
+                    dataFile.seekg(checkpoint.dataOffset);
+                }
+            }
+        }
         string url;
-        string data;
         vector<int> times;
+        times.reserve(arguments.chunkSize);
         vector<pair<string, function<bool(double)>>> checker =
         {
             make_pair("< 1000ms", [](double v) {return v < 1.0;}),
@@ -624,53 +2409,198 @@ int main(int argc, char** argv)
         {
             statisticTotal.addPredicate(c);
             statisticSuccess.addPredicate(c);
+            statisticWarmupTotal.addPredicate(c);
+            statisticWarmupSuccess.addPredicate(c);
+            statisticCooldownTotal.addPredicate(c);
+            statisticCooldownSuccess.addPredicate(c);
+        }
+        int toSend = max(arguments.limit - resumeLine, 0);
+        samples.reserve(toSend);
+        statisticTotal.reserve(toSend);
+        statisticSuccess.reserve(toSend);
+        if (!arguments.compressed.empty())
+        {
+            statisticWireBytes.reserve(toSend);
+            statisticDecodedBytes.reserve(toSend);
+            statisticDecodeTime.reserve(toSend);
+        }
+        if (!arguments.compressBody.empty())
+        {
+            statisticBodyBytes.reserve(toSend);
+            statisticBodyWireBytes.reserve(toSend);
+            statisticEncodeTime.reserve(toSend);
+            bodyHeaders = curl_slist_append(bodyHeaders, ("Content-Encoding: " + arguments.compressBody).c_str());
         }
         if (!(arguments.noBody || arguments.output == "stdout"))
         {
             output_file.open(arguments.output);
         }
 
+        installSignalHandlers();
+        if (arguments.rate > 0)
+        {
+            globalBucket.reset(new TokenBucket(arguments.rate, arguments.burst));
+        }
+        string host;
+        host.reserve(URL_BUFFER_SIZE);
+
+        Allocations allocationsStart = {0, 0};
+        Allocations allocationsSteady = {0, 0};
+        streamoff dataOffset = 0;
+        unsigned sequence = 0;
+        double nextIntended = 0;
+        rusage usageStart;
+        rusage usageEnd;
+        double producerCpu = 0;
+        double runWall = 0;
         {
+            SlabPool<Request> requests;
             ThreadPool pool;
+            RateLimiter limiter(pool, requests);
+            if (!arguments.sequent)
+            {
+                requests.reserve(arguments.chunkSize * 2);
+                pool.reserve(arguments.chunkSize * 2);
+                pool.initialize(arguments.chunkSize);
+                if (globalBucket || arguments.hostRate > 0 || !arguments.hostRates.empty())
+                {
+                    limiter.start(max<size_t>(arguments.hostRates.size(), 16), arguments.chunkSize * 2);
+                }
+            }
+            allocationsStart = countAllocations();
+            runStart = microtime();
+            getrusage(RUSAGE_SELF, &usageStart);
+            double producerCpuStart = threadCpuTime();
+            thread monitor(monitorGenerator, ref(pool), ref(limiter));
 
-            while (std::getline(file, url) && line < arguments.limit)
+            while (!interrupted.load() && line < arguments.limit && std::getline(file, url))
             {
+                if (line - resumeLine == arguments.chunkSize)
+                {
+                    allocationsSteady = countAllocations();
+                }
                 if (url != "")
                 {
+                    Request* request = requests.acquire();
+                    request->url.assign(arguments.prefix).append(url);
+                    request->line = line;
+                    request->sequence = sequence++;
+                    request->inputOffset = inputOffset;
+                    getHost(request->url, host);
+                    HostLimit* limit = getHostLimit(host);
                     if (arguments.post)
                     {
-                        data = getNextPostData(dataFile, arguments.repeatData);
+                        request->dataOffset = dataFile.is_open() ? static_cast<streamoff>(dataFile.tellg()) : 0;
+                        getNextPostData(dataFile, arguments.repeatData, request->postData);
                     }
                     if (arguments.sequent)
                     {
-                        fetch(arguments.prefix + url, arguments, data);
+                        request->intendedTime = microtime() - runStart;
+                        if (!acquireTokens(limit ? limit->bucket.get() : nullptr))
+                        {
+                            markUnsent(*request);
+                        }
+                        else
+                        {
+                            request->tokenWait = microtime() - runStart - request->intendedTime;
+                            if (!sendRequest(*request))
+                            {
+                                markUnsent(*request);
+                            }
+                        }
+                        requests.release(request);
                     }
                     else
                     {
                         if (line % arguments.chunkSize == 0 || times.empty())
                         {
-                            times = randomSum<int>(arguments.timeRange, arguments.chunkSize, arguments.minDistance);
+                            randomSum<int>(times, arguments.timeRange, arguments.chunkSize, arguments.minDistance);
                         }
 
-                        if (!pool.isInitialized())
+                        request->intendedTime = nextIntended;
+                        request->tokenWait = 0;
+                        if (limit)
                         {
-                            pool.initialize(arguments.chunkSize);
+                            limiter.submit(limit, request);
                         }
-
-                        pool.enqueue(fetch, arguments.prefix + url, arguments, data);
+                        else
+                        {
+                            postRequest(pool, requests, request);
+                        }
+                        // the next request is due one gap after this one left
+                        nextIntended = microtime() - runStart + times.back() / 1000.0;
                         std::this_thread::sleep_for(std::chrono::milliseconds(times.back()));
                         times.pop_back();
                     }
                 }
                 line++;
+                // getline drops the '\n', offsets assume one byte line endings
+                inputOffset += url.size() + 1;
+            }
+            producerCpu = threadCpuTime() - producerCpuStart;
+            if (interrupted.load())
+            {
+                printf("\nInterrupted, waiting up to %dms for in-flight requests\n", arguments.drainTimeout);
+            }
+            limiter.finish();
+            pool.clear();
+            {
+                lock_guard<mutex> lock(monitorMtx);
+                stopMonitor = true;
             }
+            monitorCondition.notify_all();
+            monitor.join();
+            getrusage(RUSAGE_SELF, &usageEnd);
+            runWall = microtime() - runStart;
             if (dataFile.is_open())
             {
+                dataFile.clear();
+                dataOffset = dataFile.tellg();
                 dataFile.close();
             }
         }
+        Allocations allocationsEnd = countAllocations();
+        if (output_file.is_open())
+        {
+            output_file.close();
+        }
+
+        Checkpoint checkpoint = {line, inputOffset, dataOffset, !interrupted.load()};
+        if (resumePoint.line >= 0)
+        {
+            checkpoint = resumePoint;
+        }
+        if (!arguments.checkpoint.empty())
+        {
+            writeCheckpoint(arguments.checkpoint, checkpoint);
+        }
+
+        int sent = line - resumeLine;
+        classifySamples(sequence);
+        steadyState = detectSteadyState();
         printStatistic(statisticTotal, statisticSuccess);
+        printPhase("Warm-up", statisticWarmupTotal, statisticWarmupSuccess);
+        printPhase("Cool-down", statisticCooldownTotal, statisticCooldownSuccess);
+        printSteadyState(steadyState);
+        generatorLoad = analyzeGenerator(usageStart, usageEnd, runWall, producerCpu);
+        printGeneratorLoad(generatorLoad);
+        if (!arguments.results.empty())
+        {
+            writeResults(arguments.results, sequence);
+        }
+        printCompression();
+        printAllocations(allocationsStart, allocationsSteady, allocationsEnd,
+                sent > arguments.chunkSize ? sent - arguments.chunkSize : 0);
         file.close();
+        if (!checkpoint.completed)
+        {
+            printf("\nStopped at line %d, %u requests were not sent or aborted.\n", checkpoint.line, unsentRequests);
+            if (!arguments.checkpoint.empty())
+            {
+                printf("Continue with --resume --checkpoint=%s\n", arguments.checkpoint.c_str());
+            }
+            return 128 + interruptSignal;
+        }
     }
     else
     {